@@ -0,0 +1,73 @@
+// Perft benchmark: checks the move generator against the known node counts
+// of the usual test positions and reports its speed.
+//
+// Build from the repository root with
+//   g++ -O2 -std=c++17 -Igym_chessengine/nnue gym_chessengine/bench.cpp gym_chessengine/nnue/*.cpp -o perft-bench -lpthread
+//
+// Usage: perft-bench [depth [threads [hash_mb [fen]]]]
+// Without a fen, runs the test positions to depth (5 by default) and exits
+// with 1 if any count is wrong. With a fen, prints the count below each
+// move of that position ("divide"). Built with -DENGINE_PROFILE, the hot
+// path profile is printed at the end.
+#include "engine.cpp"
+
+int main(int argc, char **argv) {
+    int depth = argc > 1 ? atoi(argv[1]) : 5;
+    int threads = argc > 2 ? atoi(argv[2]) : 1;
+    int hash_mb = argc > 3 ? atoi(argv[3]) : 0;
+
+    std::unique_ptr<PerftTable> table;
+    if (hash_mb > 0)
+        table.reset(new PerftTable(hash_mb));
+
+    if (argc > 4) {
+        ChessPosition pos(argv[4]);
+        move_list moves[1];
+        pos.generate_moves(moves);
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<uint64_t> nodes = perft_divide(pos, moves, depth, threads, table.get());
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        uint64_t total = 0;
+        for (int i = 0; i < moves->move_count; i++) {
+            char move_string[6];
+            pos.print_move_uci(moves->moves[i], move_string);
+            printf("%s: %llu\n", move_string, (unsigned long long)nodes[i]);
+            total += nodes[i];
+        }
+        printf("\nMoves: %d\nNodes: %llu\nTime:  %.3f s\nNPS:   %.0f\n",
+               moves->move_count, (unsigned long long)total, seconds, total / seconds);
+        if (profiling_enabled)
+            printf("\n%s", profile_report().c_str());
+        return 0;
+    }
+
+    if (depth < 1 || depth > PERFT_MAX_DEPTH) {
+        fprintf(stderr, "depth must be between 1 and %d\n", PERFT_MAX_DEPTH);
+        return 2;
+    }
+
+    int failed = 0;
+    uint64_t total_nodes = 0;
+    double total_seconds = 0;
+    for (int i = 0; i < PERFT_POSITIONS; i++) {
+        const PerftPosition *test = &perft_positions[i];
+        PerftResult result = perft_timed(ChessPosition(test->fen), depth, threads, table.get());
+        uint64_t expected = test->nodes[depth - 1];
+        int ok = result.nodes == expected;
+        failed += !ok;
+        total_nodes += result.nodes;
+        total_seconds += result.seconds;
+        printf("%-10s depth %d  %12llu nodes  %8.3f s  %6.1f Mnps  %s\n", test->name, depth,
+               (unsigned long long)result.nodes, result.seconds, result.nodes / result.seconds / 1e6,
+               ok ? "ok" : "FAILED");
+        if (!ok)
+            printf("           expected %llu\n", (unsigned long long)expected);
+    }
+    printf("total                %12llu nodes  %8.3f s  %6.1f Mnps\n",
+           (unsigned long long)total_nodes, total_seconds, total_nodes / total_seconds / 1e6);
+    if (profiling_enabled)
+        printf("\n%s", profile_report().c_str());
+    return failed ? 1 : 0;
+}
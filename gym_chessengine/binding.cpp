@@ -1,14 +1,85 @@
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 #include <pybind11/numpy.h>
+#include <optional>
+#include <map>
 #include "engine.cpp"
 
 namespace py = pybind11;
 
+// NNUE weights, loaded once and shared read-only by every board using them
+class PyNnueNetwork {
+public:
+    // With a cache path, the weights are mapped from a cache file written
+    // on first use, see nnue_network_load_cached
+    PyNnueNetwork(std::string path, std::optional<std::string> cache)
+        : path(path),
+          network(cache ? nnue_network_load_cached(path.c_str(), cache->c_str())
+                        : nnue_network_load(path.c_str()),
+                  nnue_network_free) {
+        if (!network) {
+            throw std::runtime_error("could not load NNUE file " + path);
+        }
+    }
+
+    const NnueNetwork *get() const {
+        return network.get();
+    }
+
+    std::string path;
+
+private:
+    std::shared_ptr<NnueNetwork> network;
+};
+
+// Search statistics as a dict, moves of the principal variations in UCI
+// notation
+py::dict search_stats_dict(const SearchStats &stats) {
+    py::list iterations;
+    for (const SearchIteration &iteration : stats.iterations) {
+        py::list pv;
+        for (int move : iteration.pv) {
+            char move_string[6];
+            ChessPosition::print_move_uci(move, move_string);
+            pv.append(std::string(move_string));
+        }
+        py::dict entry;
+        entry["depth"] = iteration.depth;
+        entry["score"] = iteration.score;
+        entry["pv"] = pv;
+        entry["nodes"] = iteration.nodes;
+        entry["seconds"] = iteration.seconds;
+        entry["nps"] = iteration.seconds > 0 ? iteration.nodes / iteration.seconds : 0.0;
+        iterations.append(entry);
+    }
+
+    py::dict result;
+    result["nodes"] = stats.nodes;
+    result["qnodes"] = stats.qnodes;
+    result["evals"] = stats.evals;
+    result["tt_probes"] = stats.tt_probes;
+    result["tt_hits"] = stats.tt_hits;
+    result["tt_cutoffs"] = stats.tt_cutoffs;
+    result["null_move_cutoffs"] = stats.null_move_cutoffs;
+    result["lmr_researches"] = stats.lmr_researches;
+    result["fail_highs"] = stats.fail_highs;
+    result["first_move_fail_highs"] = stats.first_move_fail_highs;
+    result["first_move_fail_high_rate"] =
+        stats.fail_highs ? (double)stats.first_move_fail_highs / stats.fail_highs : 0.0;
+    result["seconds"] = stats.seconds;
+    result["nps"] = stats.seconds > 0 ? stats.nodes / stats.seconds : 0.0;
+    result["iterations"] = iterations;
+    return result;
+}
+
 class PyChessBoard {
 public:
     PyChessBoard() : board(start_position) {}
 
+    ~PyChessBoard() {
+        stop_search();
+    }
+
     void reset(std::string fen) {
         char* fen_char = new char[fen.length() + 1];
         strcpy(fen_char, fen.c_str());
@@ -17,14 +88,48 @@ public:
     } 
     
     void init_engine() {
+        set_network(nullptr);
         board.init_nnue("gym_chessengine/nn-eba324f53044.nnue");
     }
 
+    // Evaluate with the given network, None to go back to the default one.
+    // Stops any background search, which may still be reading the weights
+    // of the network being replaced.
+    void set_network(std::shared_ptr<PyNnueNetwork> net) {
+        stop_search();
+        board.set_nnue_network(net ? net->get() : NULL);
+        network = net;
+    }
+
+    std::shared_ptr<PyNnueNetwork> get_network() {
+        return network;
+    }
+
+    // Search with the given Searcher, which can be shared by boards that
+    // don't search at the same time; None to get a private one on demand
+    void set_searcher(std::shared_ptr<Searcher> searcher) {
+        board.set_searcher(searcher);
+    }
+
+    std::shared_ptr<Searcher> get_searcher() {
+        return board.get_searcher();
+    }
+
+    // Start a game: the next search reuses nothing from earlier ones.
+    // Within a game, each search builds on the last one.
+    void new_game() {
+        stop_search();
+        board.new_game();
+    }
+
+    // Play the move from square a / 64 to square a % 64, promoting to a
+    // queen. The reward is for the side that played the move: an illegal
+    // move ends the episode with -1, and leaving the opponent without a
+    // legal move ends it with +1 for checkmate or 0 for stalemate.
     std::tuple<py::array_t<double>, double, bool> step(int a) {
-        UndoInfo undo;
         move_list move_list[1];
         board.generate_moves(move_list);
-        int move;
+        int move = 0;
 
         for (int i = 0; i < move_list->move_count; i++) {
             int64_t _move = move_list->moves[i];
@@ -33,9 +138,18 @@ public:
                 break;
             }
         }
-        if (board.make_move(move) == 0) {
+        if (move == 0) {
             return std::make_tuple(get_observation(), -1.0, true);
         }
+        board.make_move(move);
+
+        board.generate_moves(move_list);
+        if (move_list->move_count == 0) {
+            int king_square = get_lsb_index(board.piece_bitboards[board.side_to_move == white ? K : k]);
+            double reward = board.is_square_attacked(king_square, board.side_to_move ^ 1) ? 1.0 : 0.0;
+            return std::make_tuple(get_observation(), reward, true);
+        }
+        return std::make_tuple(get_observation(), 0.0, false);
     }
 
     std::string current_side(){
@@ -47,12 +161,80 @@ public:
         }
     }
 
-    int environment_move(int depth) {
-        board.search_position(depth);
-        int move = board.pv_table[0][0];
-        int start_square = decode_move_source(move);
-        int end_square = decode_move_target(move);
-        return start_square * 64 + end_square;
+    // Best move within the limits of SearchLimits, 0 meaning none; deadline
+    // is in seconds of time.monotonic(). At least one limit is needed, as
+    // nothing could stop the search otherwise. Stops any background search.
+    // With stats, the move comes with the statistics of the search.
+    py::object environment_move(int depth, double movetime, long nodes, double deadline, bool stats) {
+        if (depth <= 0 && movetime <= 0 && nodes <= 0 && deadline <= 0)
+            throw std::invalid_argument("environment_move needs a depth, movetime, nodes or deadline limit");
+        stop_search();
+        SearchLimits limits = search_limits(depth, movetime, nodes, deadline);
+        {
+            py::gil_scoped_release release;
+            board.search_position(limits);
+        }
+        if (stats)
+            return py::make_tuple(action(board.best_move()), search_stats());
+        return py::int_(action(board.best_move()));
+    }
+
+    // Statistics of the last search, background ones once collected with
+    // wait_search or stop_search
+    py::dict search_stats() {
+        if (search_thread.joinable())
+            throw std::runtime_error("the background search has not been collected");
+        const SearchStats *stats = board.search_stats();
+        return search_stats_dict(stats ? *stats : SearchStats());
+    }
+
+    // Search on a native thread, from a copy of the board, so that the board
+    // can still be played on meanwhile. Any search already running is
+    // stopped first. The move is collected with wait_search or stop_search.
+    void start_search(int depth, double movetime, long nodes, double deadline) {
+        SearchLimits limits = search_limits(depth, movetime, nodes, deadline);
+        limits.stop = &search_stop;
+        if (!board.get_searcher())
+            board.set_searcher(std::make_shared<Searcher>());
+        ChessBoard root = board;
+
+        // Under search_mutex from stopping the last search to starting this
+        // one, so that two threads can't both start one
+        py::gil_scoped_release release;
+        std::lock_guard<std::mutex> lock(search_mutex);
+        search_stop.store(1);
+        if (search_thread.joinable())
+            search_thread.join();
+        search_stop.store(0);
+        search_finished.store(0);
+
+        search_thread = std::thread([this, limits, root]() mutable {
+            root.search_position(limits);
+            search_move = root.best_move();
+            search_finished.store(1);
+        });
+    }
+
+    bool search_done() {
+        return search_finished.load();
+    }
+
+    // Wait for the search started by start_search to end within its
+    // limits, returning its move, or -1 if no search was started
+    int wait_search() {
+        py::gil_scoped_release release;
+        std::lock_guard<std::mutex> lock(search_mutex);
+        if (!search_thread.joinable())
+            return search_finished.load() ? action(search_move) : -1;
+        search_thread.join();
+        return action(search_move);
+    }
+
+    // Stop the search started by start_search; its move is that of the
+    // last iteration completed
+    int stop_search() {
+        search_stop.store(1);
+        return wait_search();
     }
 
     py::array_t<double> get_observation() {
@@ -64,13 +246,10 @@ public:
             ptr[i] = 0;
         }
 
-        for (int piece = 0; piece < 12; ++piece) {
-            for (int rank = 0; rank < 8; ++rank) {
-                for (int file = 0; file < 8; ++file) {
-                    if (get_bit(board.piece_bitboards[piece], rank * 8 + file)) {
-                        ptr[piece * 64 + rank * 8 + file] = 1.0;
-                    }
-                }
+        for (int square = 0; square < 64; ++square) {
+            int piece = board.board[square];
+            if (piece != -1) {
+                ptr[piece * 64 + square] = 1.0;
             }
         }
         return obs;
@@ -80,18 +259,248 @@ public:
         board.print_board();
     }
 
+    // Leaf nodes of the move tree to the given depth, the root moves being
+    // shared out between threads, with a perft hash table of hash_mb MB
+    uint64_t perft(int depth, int threads, int hash_mb) {
+        std::unique_ptr<PerftTable> table(hash_mb > 0 ? new PerftTable(hash_mb) : nullptr);
+        py::gil_scoped_release release;
+        return perft_timed(board, depth, threads, table.get()).nodes;
+    }
+
+    // Perft below each legal move, by move in UCI notation
+    std::map<std::string, uint64_t> perft_divide(int depth, int threads, int hash_mb) {
+        std::unique_ptr<PerftTable> table(hash_mb > 0 ? new PerftTable(hash_mb) : nullptr);
+        move_list moves[1];
+        board.generate_moves(moves);
+        std::vector<uint64_t> nodes;
+        {
+            py::gil_scoped_release release;
+            nodes = ::perft_divide(board, moves, depth, threads, table.get());
+        }
+
+        std::map<std::string, uint64_t> divide;
+        for (int i = 0; i < moves->move_count; i++) {
+            char move_string[6];
+            board.print_move_uci(moves->moves[i], move_string);
+            divide[move_string] = nodes[i];
+        }
+        return divide;
+    }
+
 private:
     ChessBoard board;
+    std::shared_ptr<PyNnueNetwork> network;
+
+    std::thread search_thread;
+    std::mutex search_mutex;
+    std::atomic<int> search_stop{0};
+    std::atomic<int> search_finished{0};
+    int search_move = 0;
+
+    static SearchLimits search_limits(int depth, double movetime, long nodes, double deadline) {
+        SearchLimits limits(depth);
+        limits.movetime = movetime;
+        limits.nodes = nodes;
+        limits.deadline = deadline;
+        return limits;
+    }
+
+    // Action of a move, as taken by step
+    static int action(int move) {
+        return decode_move_source(move) * 64 + decode_move_target(move);
+    }
 };
 
+// Evaluate a batch of observations, as returned by get_observation, each
+// from the point of view of its side to move (0 = white, 1 = black). The
+// default network is used when network is NULL.
+py::array_t<int> nnue_evaluate_observations(
+        const NnueNetwork *network,
+        py::array_t<double, py::array::c_style | py::array::forcecast> observations,
+        py::array_t<int, py::array::c_style | py::array::forcecast> sides) {
+    if (observations.ndim() != 4 || observations.shape(1) != 12 ||
+        observations.shape(2) != 8 || observations.shape(3) != 8)
+        throw std::invalid_argument("observations must have shape (N, 12, 8, 8)");
+    int n = (int)observations.shape(0);
+    if (sides.ndim() != 1 || sides.shape(0) != n)
+        throw std::invalid_argument("sides must have shape (N,)");
+
+    std::vector<int> players(sides.data(), sides.data() + n);
+    std::vector<int> pieces(NNUE_PIECES_STRIDE * n), squares(NNUE_PIECES_STRIDE * n);
+    const double *obs = observations.data();
+
+    for (int i = 0; i < n; i++) {
+        int *pos_pieces = &pieces[NNUE_PIECES_STRIDE * i];
+        int *pos_squares = &squares[NNUE_PIECES_STRIDE * i];
+        int index = 2;
+        int kings = 0;
+
+        for (int piece = P; piece <= k; piece++) {
+            for (int square = 0; square < 64; square++) {
+                if (obs[(i * 12 + piece) * 64 + square] == 0)
+                    continue;
+                if (piece == K || piece == k) {
+                    pos_pieces[piece == K ? 0 : 1] = nnue_pieces[piece];
+                    pos_squares[piece == K ? 0 : 1] = nnue_squares[square];
+                    kings++;
+                }
+                else if (index < NNUE_PIECES_STRIDE - 1) {
+                    pos_pieces[index] = nnue_pieces[piece];
+                    pos_squares[index] = nnue_squares[square];
+                    index++;
+                }
+                else
+                    throw std::invalid_argument("observation has more than 32 pieces");
+            }
+        }
+        if (kings != 2)
+            throw std::invalid_argument("observation must have exactly one king per side");
+        pos_pieces[index] = 0;
+        pos_squares[index] = 0;
+    }
+
+    py::array_t<int> scores(n);
+    int *out = scores.mutable_data();
+    {
+        py::gil_scoped_release release;
+        if (network)
+            nnue_network_evaluate_batch(network, n, players.data(), pieces.data(), squares.data(), out);
+        else
+            nnue_evaluate_batch(n, players.data(), pieces.data(), squares.data(), out);
+    }
+    return scores;
+}
+
+// Run the perft test positions to the given depth, for each giving the
+// node count found and expected and the time taken
+py::list perft_suite(int depth, int threads, int hash_mb) {
+    if (depth < 1 || depth > PERFT_MAX_DEPTH)
+        throw std::invalid_argument("depth must be between 1 and " + std::to_string(PERFT_MAX_DEPTH));
+    std::unique_ptr<PerftTable> table(hash_mb > 0 ? new PerftTable(hash_mb) : nullptr);
+
+    py::list results;
+    for (int i = 0; i < PERFT_POSITIONS; i++) {
+        const PerftPosition *test = &perft_positions[i];
+        PerftResult result;
+        {
+            py::gil_scoped_release release;
+            result = perft_timed(ChessPosition(test->fen), depth, threads, table.get());
+        }
+
+        py::dict entry;
+        entry["name"] = test->name;
+        entry["fen"] = test->fen;
+        entry["depth"] = depth;
+        entry["nodes"] = result.nodes;
+        entry["expected"] = test->nodes[depth - 1];
+        entry["ok"] = result.nodes == test->nodes[depth - 1];
+        entry["seconds"] = result.seconds;
+        entry["nps"] = result.nodes / result.seconds;
+        results.append(entry);
+    }
+    return results;
+}
+
 PYBIND11_MODULE(binding, m) {
+    m.def("nnue_arch", []() { return std::string(nnue_arch_name()); },
+          "SIMD kernels used for NNUE evaluation, picked when the network is loaded");
+    m.def("nnue_evaluate_batch",
+          [](py::array_t<double, py::array::c_style | py::array::forcecast> observations,
+             py::array_t<int, py::array::c_style | py::array::forcecast> sides) {
+              return nnue_evaluate_observations(NULL, observations, sides);
+          },
+          py::arg("observations"), py::arg("sides"),
+          "Evaluate N observations of shape (N, 12, 8, 8) for the given sides to move");
+
+    py::class_<PyNnueNetwork, std::shared_ptr<PyNnueNetwork>>(m, "NnueNetwork")
+        .def(py::init<std::string, std::optional<std::string>>(),
+             py::arg("path"), py::arg("cache") = py::none())
+        .def_readonly("path", &PyNnueNetwork::path)
+        .def("evaluate_batch",
+             [](const PyNnueNetwork &net,
+                py::array_t<double, py::array::c_style | py::array::forcecast> observations,
+                py::array_t<int, py::array::c_style | py::array::forcecast> sides) {
+                 return nnue_evaluate_observations(net.get(), observations, sides);
+             },
+             py::arg("observations"), py::arg("sides"),
+             "Evaluate N observations of shape (N, 12, 8, 8) for the given sides to move");
+
+    m.attr("profiling_enabled") = profiling_enabled;
+    m.def("profile_report", &profile_report,
+          "Time and hardware events spent in move generation, make/unmake, attack tests, move ordering and "
+          "evaluation, by thread; needs a build with ENGINE_PROFILE=1");
+    m.def("profile_reset", &profile_reset, "Start the profile counts again from zero");
+
+    m.def("perft_suite", &perft_suite, py::arg("depth") = 5, py::arg("threads") = 1, py::arg("hash_mb") = 0,
+          "Check the move generator on the usual perft positions and time it");
+
+    py::class_<PruningConfig>(m, "PruningConfig")
+        .def(py::init<>())
+        .def_readwrite("reverse_futility_depth", &PruningConfig::reverse_futility_depth)
+        .def_readwrite("reverse_futility_margin", &PruningConfig::reverse_futility_margin)
+        .def_readwrite("futility_depth", &PruningConfig::futility_depth)
+        .def_readwrite("futility_base", &PruningConfig::futility_base)
+        .def_readwrite("futility_margin", &PruningConfig::futility_margin)
+        .def_readwrite("razoring_depth", &PruningConfig::razoring_depth)
+        .def_readwrite("razoring_base", &PruningConfig::razoring_base)
+        .def_readwrite("razoring_margin", &PruningConfig::razoring_margin)
+        .def_readwrite("late_move_pruning_depth", &PruningConfig::late_move_pruning_depth)
+        .def_readwrite("late_move_pruning_base", &PruningConfig::late_move_pruning_base)
+        .def_readwrite("delta_margin", &PruningConfig::delta_margin)
+        .def_readwrite("reduction_full_moves", &PruningConfig::reduction_full_moves)
+        .def_readwrite("reduction_min_depth", &PruningConfig::reduction_min_depth)
+        .def_readwrite("reduction_base", &PruningConfig::reduction_base)
+        .def_readwrite("reduction_divisor", &PruningConfig::reduction_divisor);
+
+    py::class_<Searcher, std::shared_ptr<Searcher>>(m, "Searcher")
+        .def(py::init<size_t, int>(), py::arg("hash_mb") = DEFAULT_HASH_MB, py::arg("threads") = 1)
+        .def("clear_hash_table", &Searcher::clear_hash_table)
+        .def("new_game", &Searcher::new_game,
+             "Clear the transposition table and the move ordering learnt by earlier searches")
+        .def("set_hash_size", &Searcher::set_hash_size, py::arg("hash_mb"),
+             "Resize the transposition table to hash_mb MB, rounded down to a power of two; clears it")
+        .def_property_readonly("hash_size", &Searcher::hash_size)
+        .def("set_threads", &Searcher::set_threads, py::arg("threads"),
+             "Search with this many threads (Lazy SMP), sharing the transposition table")
+        .def_property_readonly("threads", &Searcher::threads)
+        .def_property("pruning", [](const Searcher &searcher) { return searcher.pruning_config(); },
+                      &Searcher::set_pruning_config,
+                      "Forward pruning and reduction parameters; a copy, assign it back after changing it");
+
     py::class_<PyChessBoard>(m, "PyChessBoard")
         .def(py::init<>())
         .def("reset", &PyChessBoard::reset)
         .def("init_engine", &PyChessBoard::init_engine)
+        .def("set_network", &PyChessBoard::set_network, py::arg("network"))
+        .def("get_network", &PyChessBoard::get_network)
+        .def("set_searcher", &PyChessBoard::set_searcher, py::arg("searcher"))
+        .def("get_searcher", &PyChessBoard::get_searcher)
+        .def("new_game", &PyChessBoard::new_game,
+             "Forget the searches of the previous game; moves of the same game build on each other")
         .def("step", &PyChessBoard::step)
-        .def("environment_move", &PyChessBoard::environment_move)
+        .def("environment_move", &PyChessBoard::environment_move,
+             py::arg("depth") = 0, py::arg("movetime") = 0.0, py::arg("nodes") = 0, py::arg("deadline") = 0.0,
+             py::arg("stats") = false,
+             "Engine move as from * 64 + to, searched to depth plies, for movetime seconds, for nodes "
+             "nodes or until deadline (time.monotonic()), whichever comes first; 0 for no limit, "
+             "but at least one is needed (ValueError otherwise). With stats, a (move, search_stats()) tuple")
+        .def("search_stats", &PyChessBoard::search_stats,
+             "Statistics of the last search: node, evaluation, transposition table and pruning "
+             "counters, and the depth, score, principal variation, nodes and time of each iteration")
+        .def("start_search", &PyChessBoard::start_search,
+             py::arg("depth") = 0, py::arg("movetime") = 0.0, py::arg("nodes") = 0, py::arg("deadline") = 0.0,
+             "Start searching for the engine move in the background, with the limits of environment_move; "
+             "without any, it runs until stop_search")
+        .def("search_done", &PyChessBoard::search_done)
+        .def("wait_search", &PyChessBoard::wait_search,
+             "Wait for the background search to end and return its move, -1 if none was started")
+        .def("stop_search", &PyChessBoard::stop_search,
+             "Stop the background search and return its move, -1 if none was started")
         .def("current_side", &PyChessBoard::current_side)
         .def("get_observation", &PyChessBoard::get_observation)
-        .def("print_board", &PyChessBoard::print_board);
+        .def("print_board", &PyChessBoard::print_board)
+        .def("perft", &PyChessBoard::perft,
+             py::arg("depth"), py::arg("threads") = 1, py::arg("hash_mb") = 0)
+        .def("perft_divide", &PyChessBoard::perft_divide,
+             py::arg("depth"), py::arg("threads") = 1, py::arg("hash_mb") = 0);
 }
\ No newline at end of file
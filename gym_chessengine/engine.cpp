@@ -3,16 +3,38 @@
 #include <vector>
 #include <cstring>
 #include <cstdlib>
+#include <cmath>
 #include <cctype>
 #include <unistd.h>
 #include <sys/time.h>
 #include "./nnue/nnue.h"
 #include <cassert>  // Required for assert
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define ENGINE_PEXT
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+#if defined(ENGINE_PROFILE) && defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 
 #define U64 unsigned long long
-#define get_bit(bitboard, square) ((bitboard) & (1ULL << square))
-#define set_bit(bitboard, square) ((bitboard) |= (1ULL << square))
-#define pop_bit(bitboard, square) (get_bit(bitboard, square) ? ((bitboard) ^= (1ULL << square)) : 0)
+#define get_bit(bitboard, square) ((bitboard) & (1ULL << (square)))
+#define set_bit(bitboard, square) ((bitboard) |= (1ULL << (square)))
+#define pop_bit(bitboard, square) (get_bit(bitboard, square) ? ((bitboard) ^= (1ULL << (square))) : 0)
 #define encode_move(from, to, piece, promotion, capture,  double_move, en_passant, castling) \
     ((from) | ((to) << 6) | ((piece) << 12) | ((promotion) << 16) | ((capture) << 20) | ((double_move) << 21) | ((en_passant) << 22) | ((castling) << 23))
 #define decode_move_source(move) (move & 0x3f)
@@ -24,15 +46,16 @@
 #define decode_move_en_passant(move) (((move) & 0x400000) ? 1 : 0)
 #define decode_move_castling(move) (((move) & 0x800000) ? 1 : 0)
 
-#define hash_size 100000
 #define no_hash_entry 100000
+#define NO_EVAL (-32768)
+#define DEFAULT_HASH_MB 4
 
 #define MAX_PLY 64
+#define MAX_NNUE_PLY (MAX_PLY * 2)
+#define MAX_HISTORY 16384
 #define MAX_VAL 50000
 #define MATE_VALUE 49000
 #define MATE_SCORE 48000
-#define FULL_DEPTH_MOVES 4
-#define REDUCTION_LIMIT 3
 #define start_position "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"
 
 enum squares {
@@ -46,6 +69,7 @@ enum squares {
     a1, b1, c1, d1, e1, f1, g1, h1,
 };
 enum hash_flags { hash_flag_exact, hash_flag_alpha, hash_flag_beta};
+enum move_types { all_moves, captures, quiet_moves };
 enum castling_rights {wk = 1, wq = 2, bk = 4, bq = 8};
 enum pieces { P, N, B, R, Q, K, p, n, b, r, q, k };
 
@@ -186,6 +210,11 @@ static int mvv_lva[12][12] = {
     100, 200, 300, 400, 500, 600,  100, 200, 300, 400, 500, 600
 };
 
+// Piece values for static exchange evaluation
+static const int see_values[12] = {
+    100, 320, 330, 500, 900, 20000,  100, 320, 330, 500, 900, 20000
+};
+
 void print_move(int move) {
     if (decode_move_promotion(move))
         printf("%s%s%c", square_names[decode_move_source(move)],square_names[decode_move_target(move)],get_promoted_piece_char(decode_move_promotion(move)));
@@ -205,24 +234,778 @@ void print_undo_info(UndoInfo *undo) {
 
 
 
-class ChessBoard {
+// Attack tables and Zobrist keys are the same for every board: they are
+// built once per process, by the first board, and only read afterwards
+static U64 piece_keys[12][64];
+static U64 enpassant_keys[64];
+static U64 castle_keys[16];
+static U64 side_key;
+
+static U64 pawn_attacks[2][64];
+static U64 knight_attacks[64];
+static U64 king_attacks[64];
+
+// Slider attacks of all squares, packed: each square only gets the
+// 2^rel_bits slots its index can reach, about 840 KB in all instead of the
+// 2.3 MB of a [64][4096] table. A square's mask, magic and slots pointer
+// sit together so a lookup touches one line besides the attacks.
+typedef struct {
+    U64 *attacks;
+    U64 mask;
+    U64 magic;
+    int shift;
+} SliderTable;
+
+#define BISHOP_ATTACKS_SIZE 5248
+#define ROOK_ATTACKS_SIZE 102400
+
+static SliderTable bishop_tables[64];
+static SliderTable rook_tables[64];
+static U64 slider_attacks[BISHOP_ATTACKS_SIZE + ROOK_ATTACKS_SIZE];
+static U64 between_squares[64][64];
+
+static inline int count_bits(U64 bitboard) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(bitboard);
+#else
+    int count = 0;
+    while (bitboard) {
+        count++;
+        bitboard &= (bitboard - 1);
+    }
+    return count;
+#endif
+}
+
+static inline int get_lsb_index(U64 bitboard) {
+    if (bitboard) {
+#if defined(__GNUC__)
+        return __builtin_ctzll(bitboard);
+#elif defined(_MSC_VER) && defined(_M_X64)
+        unsigned long index;
+        _BitScanForward64(&index, bitboard);
+        return (int)index;
+#else
+        return count_bits((bitboard & -bitboard) - 1);
+#endif
+    }
+    else { return -1; }
+}
+
+// Slider attacks are indexed with PEXT on CPUs where it is fast, and with
+// the magic numbers otherwise. The choice is made once, before the attack
+// tables are filled in, since both index the same tables differently.
+static bool use_pext;
+
+#if defined(ENGINE_PEXT)
+// Through inline assembly on GCC and clang, so it can sit in code built for
+// any x86-64 CPU; only executed when use_pext is set
+static inline U64 pext(U64 bitboard, U64 mask) {
+#if defined(_MSC_VER)
+    return _pext_u64(bitboard, mask);
+#else
+    U64 result;
+    __asm__("pextq %2, %1, %0" : "=r"(result) : "r"(bitboard), "r"(mask));
+    return result;
+#endif
+}
+
+static void cpuid(unsigned int leaf, unsigned int regs[4]) {
+#if defined(_MSC_VER)
+    __cpuidex((int *)regs, (int)leaf, 0);
+#else
+    __cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// BMI2, except on AMD CPUs before Zen 3 where PEXT is microcoded and much
+// slower than a magic multiply
+static bool has_fast_pext() {
+    unsigned int regs[4];
+    cpuid(0, regs);
+    unsigned int max_leaf = regs[0];
+    bool amd = regs[1] == 0x68747541; // "Auth"enticAMD
+    if (max_leaf < 7)
+        return false;
+    cpuid(1, regs);
+    unsigned int family = (regs[0] >> 8) & 0xf;
+    if (family == 0xf)
+        family += (regs[0] >> 20) & 0xff;
+    cpuid(7, regs);
+    bool bmi2 = (regs[1] >> 8) & 1;
+    return bmi2 && !(amd && family < 0x19);
+}
+#else
+static inline U64 pext(U64 bitboard, U64 mask) {
+    return 0ULL;
+}
+
+static bool has_fast_pext() {
+    return false;
+}
+#endif
+
+static inline U64 slider_lookup(const SliderTable *table, U64 block) {
+    if (use_pext)
+        return table->attacks[pext(block, table->mask)];
+    return table->attacks[((block & table->mask) * table->magic) >> table->shift];
+}
+
+// SplitMix64. Keys built from a 32-bit xorshift state, as before, all lay
+// in a 32-dimensional space, so a few XORed keys often cancelled out and
+// different positions got the same hash key.
+static U64 rd_state;
+
+static U64 get_random_U64_number(){
+    U64 x = (rd_state += 0x9e3779b97f4a7c15ULL);
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static void init_random_keys(){
+    rd_state = 1804289383;
+
+    for (int piece = P; piece <= k; piece++){
+        for (int square = 0; square < 64; square++)
+            piece_keys[piece][square] = get_random_U64_number();
+    }
+    
+    for (int square = 0; square < 64; square++)
+        enpassant_keys[square] = get_random_U64_number();
+    
+    for (int index = 0; index < 16; index++)
+        castle_keys[index] = get_random_U64_number();
+        
+    side_key = get_random_U64_number();
+}
+
+static U64 mask_pawn_attacks(int color, int square){
+    U64 attacks = 0ULL;
+    U64 bitboard = 0ULL;
+    set_bit(bitboard, square);
+    if (color == white){
+        if ((bitboard >> 7) & not_a_file){attacks |= (bitboard >> 7);}
+        if ((bitboard >> 9) & not_h_file){attacks |= (bitboard >> 9);}
+
+    } else {
+        if ((bitboard << 9) & not_a_file){attacks |= (bitboard << 9);}
+        if ((bitboard << 7) & not_h_file){attacks |= (bitboard << 7);}
+    }
+    return attacks;
+}
+
+static U64 mask_knight_attacks(int square){
+    U64 attacks = 0ULL;
+    U64 bitboard = 0ULL;
+    set_bit(bitboard, square);
+
+    if ((bitboard >> 17) & not_h_file){attacks |= (bitboard >> 17);}
+    if ((bitboard >> 15) & not_a_file){attacks |= (bitboard >> 15);}
+    if ((bitboard >> 10) & not_hg_file){attacks |= (bitboard >> 10);}
+    if ((bitboard >> 6 ) & not_ab_file){attacks |= (bitboard >> 6);}
+
+    if ((bitboard << 17) & not_a_file){attacks |= (bitboard << 17);}
+    if ((bitboard << 15) & not_h_file){attacks |= (bitboard << 15);}
+    if ((bitboard << 10) & not_ab_file){attacks |= (bitboard << 10);}
+    if ((bitboard << 6 ) & not_hg_file){attacks |= (bitboard << 6);}
+    return attacks;
+}
+
+static U64 mask_king_attacks(int square){
+    U64 attacks = 0ULL;
+    U64 bitboard = 0ULL;
+    set_bit(bitboard, square);
+
+    if ((bitboard >> 7) & not_a_file){attacks |= (bitboard >> 7);}
+    if ((bitboard >> 8)){attacks |= (bitboard >> 8);}
+    if ((bitboard >> 9) & not_h_file){attacks |= (bitboard >> 9);}
+
+    if ((bitboard << 7) & not_h_file){attacks |= (bitboard << 7);}
+    if ((bitboard << 8)){attacks |= (bitboard << 8);}
+    if ((bitboard << 9) & not_a_file){attacks |= (bitboard << 9);}
+    
+    if ((bitboard >> 1) & not_h_file){attacks |= (bitboard >> 1);}
+    if ((bitboard << 1) & not_a_file){attacks |= (bitboard << 1);}
+    return attacks;
+}
+
+static U64 mask_bishop_attacks(int square){
+    U64 attacks = 0ULL;
+    int tr = square/8, tf = square%8;
+
+    for (int r=tr+1, f = tf+1; r < 7 && f < 7; r++, f++){
+        attacks |= (1ULL << (r*8 + f));
+    }
+    for (int r=tr+1, f = tf-1; r < 7 && f >= 1; r++, f--){
+        attacks |= (1ULL << (r*8 + f));
+    }
+    for (int r=tr-1, f = tf+1; r >= 1 && f < 7; r--, f++){
+        attacks |= (1ULL << (r*8 + f));
+    }
+    for (int r=tr-1, f = tf-1; r >= 1 && f >= 1; r--, f--){
+        attacks |= (1ULL << (r*8 + f));
+    }
+    return attacks;
+}
+
+static U64 bishop_attacks_otf(int square, U64 block){
+    U64 attacks = 0ULL;
+    int r, f;
+    int tr = square / 8;
+    int tf = square % 8;
+    
+    for (r = tr + 1, f = tf + 1; r <= 7 && f <= 7; r++, f++){
+        attacks |= (1ULL << (r * 8 + f));
+        if ((1ULL << (r * 8 + f)) & block) break;
+    }
+    
+    for (r = tr - 1, f = tf + 1; r >= 0 && f <= 7; r--, f++){
+        attacks |= (1ULL << (r * 8 + f));
+        if ((1ULL << (r * 8 + f)) & block) break;
+    }
+    
+    for (r = tr + 1, f = tf - 1; r <= 7 && f >= 0; r++, f--){
+        attacks |= (1ULL << (r * 8 + f));
+        if ((1ULL << (r * 8 + f)) & block) break;
+    }
+    
+    for (r = tr - 1, f = tf - 1; r >= 0 && f >= 0; r--, f--){
+        attacks |= (1ULL << (r * 8 + f));
+        if ((1ULL << (r * 8 + f)) & block) break;
+    }
+    
+    return attacks;
+}
+
+static U64 mask_rook_attacks(int square){
+    U64 attacks = 0ULL;
+    int tr = square/8, tf = square%8;
+
+    for (int r=tr+1; r<7; r++){
+        attacks |= (1ULL << (r*8 + tf));
+    }
+    for (int r=tr-1; r>=1; r--){
+        attacks |= (1ULL << (r*8 + tf));
+    }
+    for (int f=tf+1; f<7; f++){
+        attacks |= (1ULL << (tr*8 + f));
+    }
+    for (int f=tf-1; f>=1; f--){
+        attacks |= (1ULL << (tr*8 + f));
+    }
+    return attacks;
+}
+
+static U64 rook_attacks_otf(int square, U64 blocking_pieces){
+    U64 attacks = 0ULL;
+    int tr = square/8, tf = square%8;
+
+    for (int r=tr+1; r<=7; r++){
+        attacks |= (1ULL << (r*8 + tf));
+        if ((1ULL << (r*8 + tf)) & blocking_pieces){break;}
+    }
+    for (int r=tr-1; r>=0; r--){
+        attacks |= (1ULL << (r*8 + tf));
+        if ((1ULL << (r*8 + tf)) & blocking_pieces){break;}
+
+    }
+    for (int f=tf+1; f<=7; f++){
+        attacks |= (1ULL << (tr*8 + f));
+        if ((1ULL << (tr*8 + f)) & blocking_pieces){break;}
+    }
+    for (int f=tf-1; f>=0; f--){
+        attacks |= (1ULL << (tr*8 + f));
+        if ((1ULL << (tr*8 + f)) & blocking_pieces){break;}
+
+    }
+    return attacks;
+}
+
+static U64 set_block(int index, int n_bits_in_mask, U64 attack_mask){
+    U64 block = 0ULL;
+    for (int i = 0; i < n_bits_in_mask; i++){
+        int square = get_lsb_index(attack_mask);
+        pop_bit(attack_mask, square);
+        if (index & (1 << i)) {
+            set_bit(block, square);
+        }
+    }
+    return block;
+}
+
+static void init_all(){
+    init_random_keys();
+    use_pext = has_fast_pext();
+
+    for (int color = 0; color < 2; color++){
+        for (int square = 0; square < 64; square++){
+            pawn_attacks[color][square] = mask_pawn_attacks(color, square);
+        }
+    }
+    
+    for (int square = 0; square < 64; square++){
+        knight_attacks[square] = mask_knight_attacks(square);
+        king_attacks[square] = mask_king_attacks(square);
+    }
+
+    U64 *slots = slider_attacks;
+
+    for (int square = 0; square < 64; square++){
+        SliderTable *table = &bishop_tables[square];
+        table->attacks = slots;
+        table->mask = mask_bishop_attacks(square);
+        table->magic = bishop_magic[square];
+        table->shift = 64 - bishop_rel_bits[square];
+        int relevant_bits = count_bits(table->mask);
+        int block_indicies = 1 << relevant_bits;
+        assert(relevant_bits == bishop_rel_bits[square]);
+
+        for (int i = 0; i < block_indicies; i++){
+            U64 block = set_block(i, relevant_bits, table->mask);
+            table->attacks[use_pext ? pext(block, table->mask) : (block * table->magic) >> table->shift] = bishop_attacks_otf(square, block);
+        }
+        slots += block_indicies;
+    }
+    assert(slots == slider_attacks + BISHOP_ATTACKS_SIZE);
+
+    for (int square = 0; square < 64; square++){
+        SliderTable *table = &rook_tables[square];
+        table->attacks = slots;
+        table->mask = mask_rook_attacks(square);
+        table->magic = rook_magic[square];
+        table->shift = 64 - rook_rel_bits[square];
+        int relevant_bits = count_bits(table->mask);
+        int block_indicies = 1 << relevant_bits;
+        assert(relevant_bits == rook_rel_bits[square]);
+
+        for (int i = 0; i < block_indicies; i++){
+            U64 block = set_block(i, relevant_bits, table->mask);
+            table->attacks[use_pext ? pext(block, table->mask) : (block * table->magic) >> table->shift] = rook_attacks_otf(square, block);
+        }
+        slots += block_indicies;
+    }
+    assert(slots == slider_attacks + BISHOP_ATTACKS_SIZE + ROOK_ATTACKS_SIZE);
+
+    // Squares strictly between two squares on the same line, 0 otherwise
+    for (int from = 0; from < 64; from++){
+        for (int to = 0; to < 64; to++){
+            if (rook_attacks_otf(from, 0ULL) & (1ULL << to))
+                between_squares[from][to] = rook_attacks_otf(from, 1ULL << to) & rook_attacks_otf(to, 1ULL << from);
+            else if (bishop_attacks_otf(from, 0ULL) & (1ULL << to))
+                between_squares[from][to] = bishop_attacks_otf(from, 1ULL << to) & bishop_attacks_otf(to, 1ULL << from);
+        }
+    }
+}
+
+static void init_tables(){
+    static std::once_flag tables_initialized;
+    std::call_once(tables_initialized, init_all);
+}
+
+// Hot path profiling, compiled in with ENGINE_PROFILE defined. A
+// PROFILE_SCOPE times the rest of its block in time stamp counter ticks
+// and, on Linux where perf_event_open is allowed, counts the CPU cycles,
+// cache misses and branch misses of the thread meanwhile. Scopes nest, the
+// self counts leaving out those of the scopes opened inside. Each thread
+// keeps its own counts; those of threads that are gone are added together.
+// Without ENGINE_PROFILE, PROFILE_SCOPE is empty.
+enum profile_scopes { profile_generate_moves, profile_apply_move, profile_revert_move,
+                      profile_is_square_attacked, profile_move_ordering, profile_evaluate, PROFILE_SCOPES };
+
+#ifdef ENGINE_PROFILE
+static const bool profiling_enabled = true;
+
+static const char *profile_scope_names[PROFILE_SCOPES] = {
+    "generate_moves", "apply_move", "revert_move", "is_square_attacked", "move_ordering", "evaluate"
+};
+
+enum profile_events { profile_cycles, profile_cache_misses, profile_branch_misses, PROFILE_EVENTS };
+
+static const char *profile_event_names[PROFILE_EVENTS] = { "cycles", "cache_misses", "branch_misses" };
+
+// Ticks, then the events
+#define PROFILE_COUNTERS (1 + PROFILE_EVENTS)
+
+static inline U64 profile_ticks() {
+#if defined(_MSC_VER) && defined(_M_X64)
+    return __rdtsc();
+#elif defined(__x86_64__)
+    unsigned int low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((U64)high << 32) | low;
+#elif defined(__aarch64__)
+    U64 ticks;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// A hardware counter of the calling thread, user space only. It is read
+// with rdpmc when the kernel lets us, which costs a few cycles, and with a
+// read() system call otherwise.
+struct ProfileEvent {
+#if defined(__linux__)
+    int fd = -1;
+    perf_event_mmap_page *page = NULL;
+
+    bool open(U64 config) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd < 0)
+            return false;
+        void *map = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+        page = (map == MAP_FAILED) ? NULL : (perf_event_mmap_page *)map;
+        return true;
+    }
+
+    void close() {
+        if (page)
+            munmap(page, sysconf(_SC_PAGESIZE));
+        if (fd >= 0)
+            ::close(fd);
+        page = NULL;
+        fd = -1;
+    }
+
+    bool user_readable() const {
+        return page && page->cap_user_rdpmc;
+    }
+
+    U64 read() const {
+#if defined(__x86_64__)
+        // The kernel bumps lock around any change to the mapped page;
+        // index is 0 while the counter is off the PMU
+        if (user_readable()) {
+            U64 count;
+            unsigned int lock, index;
+            do {
+                lock = page->lock;
+                __asm__ __volatile__("" ::: "memory");
+                index = page->index;
+                count = page->offset;
+                if (index) {
+                    unsigned int low, high;
+                    __asm__ __volatile__("rdpmc" : "=a"(low), "=d"(high) : "c"(index - 1));
+                    int shift = 64 - page->pmc_width;
+                    count += (U64)((long long)((((U64)high << 32) | low) << shift) >> shift);
+                }
+                __asm__ __volatile__("" ::: "memory");
+            } while (page->lock != lock);
+            if (index)
+                return count;
+        }
+#endif
+        U64 count = 0;
+        if (::read(fd, &count, sizeof(count)) != (ssize_t)sizeof(count))
+            return 0;
+        return count;
+    }
+#else
+    bool open(U64 config) { return false; }
+    void close() {}
+    bool user_readable() const { return false; }
+    U64 read() const { return 0; }
+#endif
+};
+
+// Counts of a thread, by scope. Only the thread itself adds to them, but
+// they are read by the report from other threads.
+struct ThreadProfile {
+    std::atomic<U64> calls[PROFILE_SCOPES];
+    std::atomic<U64> total[PROFILE_SCOPES][PROFILE_COUNTERS];
+    std::atomic<U64> self[PROFILE_SCOPES][PROFILE_COUNTERS];
+    U64 children[PROFILE_COUNTERS];  // of the innermost open scope so far
+    ProfileEvent events[PROFILE_EVENTS];
+    bool events_open = false;
+
+    ThreadProfile() {
+        reset();
+        memset(children, 0, sizeof(children));
+    }
+
+    void reset() {
+        for (int scope = 0; scope < PROFILE_SCOPES; scope++) {
+            calls[scope].store(0, std::memory_order_relaxed);
+            for (int counter = 0; counter < PROFILE_COUNTERS; counter++) {
+                total[scope][counter].store(0, std::memory_order_relaxed);
+                self[scope][counter].store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void add(const ThreadProfile &other) {
+        for (int scope = 0; scope < PROFILE_SCOPES; scope++) {
+            add(calls[scope], other.calls[scope].load(std::memory_order_relaxed));
+            for (int counter = 0; counter < PROFILE_COUNTERS; counter++) {
+                add(total[scope][counter], other.total[scope][counter].load(std::memory_order_relaxed));
+                add(self[scope][counter], other.self[scope][counter].load(std::memory_order_relaxed));
+            }
+        }
+    }
+
+    // All the events or none, so that the columns of a report match
+    void open_events() {
+#if defined(__linux__)
+        static const U64 configs[PROFILE_EVENTS] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+        };
+#else
+        static const U64 configs[PROFILE_EVENTS] = {};
+#endif
+        events_open = true;
+        for (int event = 0; event < PROFILE_EVENTS; event++)
+            events_open = events_open && events[event].open(configs[event]);
+        if (!events_open)
+            close_events();
+    }
+
+    void close_events() {
+        for (int event = 0; event < PROFILE_EVENTS; event++)
+            events[event].close();
+    }
+
+    void read(U64 counters[PROFILE_COUNTERS]) const {
+        counters[0] = profile_ticks();
+        for (int event = 0; event < PROFILE_EVENTS; event++)
+            counters[1 + event] = events_open ? events[event].read() : 0;
+    }
+
+    static void add(std::atomic<U64> &counter, U64 value) {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+};
+
+// Live threads, those gone, and when the first thread started profiling,
+// to work out the tick rate
+static std::mutex profile_mutex;
+static std::vector<ThreadProfile *> profile_threads;
+static ThreadProfile profile_exited;
+static U64 profile_start_ticks;
+static double profile_start_seconds;
+
+// The profile of the calling thread, set up on first use and folded into
+// profile_exited when the thread ends
+static ThreadProfile *thread_profile() {
+    struct Holder {
+        ThreadProfile profile;
+
+        Holder() {
+            profile.open_events();
+            std::lock_guard<std::mutex> lock(profile_mutex);
+            if (!profile_start_ticks) {
+                profile_start_ticks = profile_ticks();
+                profile_start_seconds = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+            }
+            profile_threads.push_back(&profile);
+        }
+
+        ~Holder() {
+            profile.close_events();
+            std::lock_guard<std::mutex> lock(profile_mutex);
+            profile_exited.add(profile);
+            for (size_t i = 0; i < profile_threads.size(); i++)
+                if (profile_threads[i] == &profile) {
+                    profile_threads.erase(profile_threads.begin() + i);
+                    break;
+                }
+        }
+    };
+    static thread_local Holder holder;
+    return &holder.profile;
+}
+
+class ProfileScope {
+public:
+    explicit ProfileScope(int scope) : scope(scope), profile(thread_profile()) {
+        memcpy(outer_children, profile->children, sizeof(outer_children));
+        memset(profile->children, 0, sizeof(profile->children));
+        profile->read(start);
+    }
+
+    ~ProfileScope() {
+        U64 end[PROFILE_COUNTERS];
+        profile->read(end);
+        ThreadProfile::add(profile->calls[scope], 1);
+        for (int counter = 0; counter < PROFILE_COUNTERS; counter++) {
+            U64 elapsed = end[counter] - start[counter];
+            ThreadProfile::add(profile->total[scope][counter], elapsed);
+            ThreadProfile::add(profile->self[scope][counter], elapsed - profile->children[counter]);
+            profile->children[counter] = outer_children[counter] + elapsed;
+        }
+    }
+
+private:
+    int scope;
+    ThreadProfile *profile;
+    U64 start[PROFILE_COUNTERS];
+    U64 outer_children[PROFILE_COUNTERS];
+};
+
+#define PROFILE_SCOPE(scope) ProfileScope profile_scope_guard(scope)
+
+static void profile_append_rows(std::string *report, const char *title, const ThreadProfile &profile,
+                                bool events, double ticks_per_second) {
+    U64 calls = 0;
+    for (int scope = 0; scope < PROFILE_SCOPES; scope++)
+        calls += profile.calls[scope].load(std::memory_order_relaxed);
+    if (!calls)
+        return;
+
+    char line[256];
+    snprintf(line, sizeof(line), "%s\n%-20s %12s %10s %10s %9s", title, "scope", "calls", "total ms", "self ms",
+             "self/call");
+    *report += line;
+    if (events)
+        for (int event = 0; event < PROFILE_EVENTS; event++) {
+            snprintf(line, sizeof(line), " %16s", profile_event_names[event]);
+            *report += line;
+        }
+    *report += "\n";
+
+    for (int scope = 0; scope < PROFILE_SCOPES; scope++) {
+        U64 calls = profile.calls[scope].load(std::memory_order_relaxed);
+        if (!calls)
+            continue;
+        double total = profile.total[scope][0].load(std::memory_order_relaxed);
+        double self = profile.self[scope][0].load(std::memory_order_relaxed);
+        snprintf(line, sizeof(line), "%-20s %12llu %10.1f %10.1f %9.1f", profile_scope_names[scope], calls,
+                 total * 1000 / ticks_per_second, self * 1000 / ticks_per_second, self / calls);
+        *report += line;
+        if (events)
+            for (int event = 0; event < PROFILE_EVENTS; event++) {
+                snprintf(line, sizeof(line), " %16.2f",
+                         (double)profile.self[scope][1 + event].load(std::memory_order_relaxed) / calls);
+                *report += line;
+            }
+        *report += "\n";
+    }
+}
+
+// The counts so far: by thread, then added up, with the self ticks and
+// hardware events per call
+static inline std::string profile_report() {
+    ThreadProfile *own = thread_profile();
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count() - profile_start_seconds;
+    double ticks_per_second = seconds > 0 ? (profile_ticks() - profile_start_ticks) / seconds : 1;
+
+    std::string report;
+    char line[256];
+    snprintf(line, sizeof(line), "ticks at %.3f GHz, hardware events %s\n", ticks_per_second / 1e9,
+             !own->events_open ? "unavailable" : own->events[0].user_readable() ? "read with rdpmc" : "read with read()");
+    report += line;
+
+    ThreadProfile all;
+    all.add(profile_exited);
+    for (size_t i = 0; i < profile_threads.size(); i++) {
+        snprintf(line, sizeof(line), "\nthread %d", (int)i + 1);
+        profile_append_rows(&report, line, *profile_threads[i], own->events_open, ticks_per_second);
+        all.add(*profile_threads[i]);
+    }
+    profile_append_rows(&report, "\nthreads gone", profile_exited, own->events_open, ticks_per_second);
+    profile_append_rows(&report, "\nall threads", all, own->events_open, ticks_per_second);
+    return report;
+}
+
+// Start counting again from zero; best done while nothing is searching
+static inline void profile_reset() {
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    profile_exited.reset();
+    for (size_t i = 0; i < profile_threads.size(); i++)
+        profile_threads[i]->reset();
+}
+#else
+static const bool profiling_enabled = false;
+
+#define PROFILE_SCOPE(scope)
+
+static inline std::string profile_report() {
+    return "profiling not compiled in, build with ENGINE_PROFILE defined\n";
+}
+
+static inline void profile_reset() {
+}
+#endif
+
+// Perft counts already found, which can be shared by the threads of a
+// perft. An entry keeps its key xor its count, so one torn by two threads
+// writing at once just doesn't match any more.
+class PerftTable {
+public:
+    PerftTable(size_t size_mb) {
+        size = size_mb * 1024 * 1024 / sizeof(Entry);
+        if (size == 0)
+            size = 1;
+        entries.reset(new Entry[size]);
+        clear();
+    }
+
+    void clear() {
+        for (size_t i = 0; i < size; i++) {
+            entries[i].check.store(0, std::memory_order_relaxed);
+            entries[i].nodes.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    int probe(U64 hash_key, int depth, uint64_t *nodes) {
+        U64 key = depth_key(hash_key, depth);
+        Entry *entry = &entries[key % size];
+        U64 count = entry->nodes.load(std::memory_order_relaxed);
+        if ((entry->check.load(std::memory_order_relaxed) ^ count) != key)
+            return 0;
+        *nodes = count;
+        return 1;
+    }
+
+    void store(U64 hash_key, int depth, uint64_t nodes) {
+        U64 key = depth_key(hash_key, depth);
+        Entry *entry = &entries[key % size];
+        entry->check.store(key ^ nodes, std::memory_order_relaxed);
+        entry->nodes.store(nodes, std::memory_order_relaxed);
+    }
+
+private:
+    struct Entry {
+        std::atomic<U64> check;
+        std::atomic<U64> nodes;
+    };
+
+    std::unique_ptr<Entry[]> entries;
+    size_t size;
+
+    static U64 depth_key(U64 hash_key, int depth) {
+        return hash_key ^ ((U64)depth * 0x9e3779b97f4a7c15ULL);
+    }
+};
+
+// Game state only: cheap to copy and to step through moves. The search
+// data lives in Searcher and the moves played in ChessBoard.
+class ChessPosition {
 public:
     // State Attributes
     U64 piece_bitboards[12];
     U64 block_bitboards[3];
+    signed char board[64];  // piece on each square, -1 when empty
     int side_to_move;
     int en_passant_square;
     int castling_rights;
     int fifty;
     U64 hash_key;
-    U64 repetition_table[150];
-    int repetition_index;
-    int pv_table[MAX_PLY][MAX_PLY];
-    int move_index;
-    UndoInfo undo_stack[150];
 
-    ChessBoard(const std::string& fen) {
-        init_all();
+    ChessPosition(const std::string& fen = start_position) {
+        init_tables();
         char* fen_char = new char[fen.length() + 1];
         strcpy(fen_char, fen.c_str());
         parse_fen(fen_char);
@@ -232,6 +1015,7 @@ public:
     void parse_fen(char *fen){
         memset(piece_bitboards, 0ULL, sizeof(piece_bitboards));
         memset(block_bitboards, 0ULL, sizeof(block_bitboards));
+        memset(board, -1, sizeof(board));
         
         side_to_move = 0;
         en_passant_square = -1;
@@ -244,19 +1028,14 @@ public:
                 if ((*fen >= 'a' && *fen <= 'z') || (*fen >= 'A' && *fen <= 'Z')){
                     int piece = get_piece_from_char(*fen);
                     set_bit(piece_bitboards[piece], square);
+                    board[square] = piece;
                     *fen++;
                 }
                 
                 if (*fen >= '0' && *fen <= '9'){
                     int offset = *fen - '0';
-                    int piece = -1;
-                    
-                    for (int bb_piece = P; bb_piece <= k; bb_piece++){
-                        if (get_bit(piece_bitboards[bb_piece], square))
-                            piece = bb_piece;
-                    }
                     
-                    if (piece == -1)
+                    if (board[square] == -1)
                         file--;
                     
                     file += offset;
@@ -317,13 +1096,7 @@ public:
                 if (file == 0){
                     printf(" %d ", 8 - rank);
                 }
-                int piece_found = -1;
-                for (int piece = 0; piece < 12; piece++) {
-                    if (get_bit(piece_bitboards[piece], rank * 8 + file)) {
-                        piece_found = piece;
-                        break;
-                    }
-                }
+                int piece_found = board[rank * 8 + file];
                 if(piece_found != -1) {
                     printf(" %s ", unicode_pieces[piece_found]);
                 } else {
@@ -344,7 +1117,6 @@ public:
                (castling_rights & wq ? 'Q' : '-'),
                (castling_rights & bk ? 'k' : '-'),
                (castling_rights & bq ? 'q' : '-'));
-        printf("Move Index:        %d\n\n", move_index);
     }
 
 
@@ -370,60 +1142,6 @@ public:
         return 0;
     }
 
-    int make_move(int move){
-        UndoInfo undo;
-        int is_legal = apply_move(move, 0, &undo);
-        if (is_legal){
-            undo_stack[move_index] = undo;
-            move_index++;
-        }
-        return is_legal;
-    }
-
-    void undo_move(){
-        move_index--;
-        revert_move(undo_stack[move_index]);
-    }
-
-    void search_position(int depth){
-        int score = 0;
-        nodes = 0;
-        ply = 0;
-        follow_pv = 0;
-        score_pv = 0;
-        memset(pv_table, 0, sizeof(pv_table));
-        memset(pv_length, 0, sizeof(pv_length));
-        memset(killer_moves, 0, sizeof(killer_moves));
-        memset(history_moves, 0, sizeof(history_moves));
-
-        int alpha = -MAX_VAL;
-        int beta = MAX_VAL;
-        
-        for (int current_depth = 1; current_depth <= depth; current_depth++){
-            follow_pv = 1;
-            score = negamax(current_depth, alpha, beta);
-            if ((score <= alpha) || (score >= beta)){
-                alpha = -MAX_VAL;
-                beta = MAX_VAL;
-                continue;
-            }
-            alpha = score - 50;
-            beta = score + 50;
-
-            // printf("info score cp %d depth %d nodes %ld pv ", score, current_depth, nodes);
-            // for (int i = 0; i < pv_length[0]; i++){
-            //     print_move(pv_table[0][i]);
-            //     printf(" ");
-            // }
-            // printf("\n");
-
-        }
-        // printf("\n");
-        // printf("bestmove ");
-        // print_move(pv_table[0][0]);
-        // printf("\n");
-    }
-
     int piece_sum() {
         int sum = 0;
         for (int i = P; i <= k; i++) {
@@ -432,29 +1150,37 @@ public:
         return sum;
     }
 
-    uint64_t perft(int depth) {
+    // Leaf nodes of the move tree to the given depth. The moves at depth 1
+    // are counted without being made, since they are all legal.
+    uint64_t perft(int depth, PerftTable *table = NULL) {
         if (depth == 0) {
             return 1; // Leaf node reached
         }
 
         uint64_t nodes = 0;
+        if (table && depth > 1 && table->probe(hash_key, depth, &nodes))
+            return nodes;
+
         move_list moves;
         generate_moves(&moves);
 
+        if (depth == 1)
+            return moves.move_count;
+
         for (int i = 0; i < moves.move_count; i++) {
             UndoInfo undo;
 
-            if (!apply_move(moves.moves[i], 0, &undo))
-                continue;
-
-            nodes += perft(depth - 1);
+            apply_move(moves.moves[i], 0, &undo);
+            nodes += perft(depth - 1, table);
 
             revert_move(undo);
         }
 
+        if (table)
+            table->store(hash_key, depth, nodes);
         return nodes;
     }
-    void print_move_uci(int move, char* move_string) {
+    static void print_move_uci(int move, char* move_string) {
         if (decode_move_promotion(move)) {
             sprintf(move_string, "%s%s%c", square_names[decode_move_source(move)], square_names[decode_move_target(move)], get_promoted_piece_char(decode_move_promotion(move)));
         } else {
@@ -462,306 +1188,82 @@ public:
         }
     }
 
-    void generate_moves(move_list* moves_list){
-        moves_list->move_count = 0;
-        int source_square, target_square;
-        U64 piece_bitboards_copy, attacks;
+    // Legal move generation. The checking pieces and the pinned pieces are
+    // worked out once per position, so every move added here can be made
+    // without testing afterwards whether it leaves the king in check.
+    // move_type picks all moves, only captures (en passant included) or only
+    // the others, so the search can put off generating quiet moves.
+    void generate_moves(move_list* moves_list, int move_type = all_moves){
+        PROFILE_SCOPE(profile_generate_moves);
+        if (side_to_move == white)
+            generate_moves<white>(moves_list, move_type);
+        else
+            generate_moves<black>(moves_list, move_type);
+    }
 
-        for (int piece = P; piece <= k; piece++){
-            piece_bitboards_copy = piece_bitboards[piece];
-            // White pawns
-            if (side_to_move == white && piece == P){
-                while (piece_bitboards_copy){
-                    source_square = get_lsb_index(piece_bitboards_copy);
-                    target_square = source_square - 8;
-                    if (target_square >= 0 && target_square < 64 && !get_bit(block_bitboards[2], target_square)){
-                        if (source_square >= a7 && source_square <= h7){
-                            add_move(moves_list, encode_move(source_square, target_square, piece, Q, 0, 0, 0, 0));
-                            add_move(moves_list, encode_move(source_square, target_square, piece, R, 0, 0, 0, 0));
-                            add_move(moves_list, encode_move(source_square, target_square, piece, B, 0, 0, 0, 0));
-                            add_move(moves_list, encode_move(source_square, target_square, piece, N, 0, 0, 0, 0));
-                        }
-                        else{
-                            if (!get_bit(block_bitboards[2], target_square)){
-                                add_move(moves_list, encode_move(source_square, target_square, piece, 0, 0, 0, 0, 0));
-                            }
-                            if (source_square >= a2 && source_square <= h2 && !get_bit(block_bitboards[2], target_square - 8)){
-                                add_move(moves_list, encode_move(source_square, target_square - 8, piece, 0, 0, 1, 0, 0));
-                            }
-                        }
-                    }
-                    attacks = pawn_attacks[white][source_square] & block_bitboards[black];
-                    while (attacks){
-                        target_square = get_lsb_index(attacks);
-                        if (source_square >= a7 && source_square <= h7){
-                            add_move(moves_list, encode_move(source_square, target_square, piece, Q, 1, 0, 0, 0));
-                            add_move(moves_list, encode_move(source_square, target_square, piece, R, 1, 0, 0, 0));
-                            add_move(moves_list, encode_move(source_square, target_square, piece, B, 1, 0, 0, 0));
-                            add_move(moves_list, encode_move(source_square, target_square, piece, N, 1, 0, 0, 0));               
-                        }
-                        else {
-                            add_move(moves_list, encode_move(source_square, target_square, piece, 0, 1, 0, 0, 0));
-                        } 
-                        pop_bit(attacks, target_square);
-                    }
+    // Whether a move from elsewhere, like the transposition table or a killer
+    // slot, can be played in this position. Only castling and en passant,
+    // which are rare, are looked up in the generated moves.
+    int is_legal_move(int move){
+        int source_square = decode_move_source(move);
+        int target_square = decode_move_target(move);
+        int piece = decode_move_piece(move);
+        int promoted_piece = decode_move_promotion(move);
+        int capture = decode_move_capture(move);
+        int own = (side_to_move == white) ? P : p;
+        U64 enemy_pieces = block_bitboards[side_to_move ^ 1];
+
+        if (!move || piece < own || piece > K + own || board[source_square] != piece)
+            return 0;
 
-                    if (en_passant_square != -1){
-                        U64 enpassant_attacks= pawn_attacks[white][source_square] & (1ULL << en_passant_square);
-                        if (enpassant_attacks){
-                            target_square = get_lsb_index(enpassant_attacks);
-                            add_move(moves_list, encode_move(source_square, target_square, piece, 0, 1, 0, 1, 0));    
-                        }
-                    }
-                    pop_bit(piece_bitboards_copy, source_square);
-                }
-            }
-            // White king castles
-            if (side_to_move == white && piece == K){
-                if (castling_rights & wk){
-                    if (!get_bit(block_bitboards[2], f1) && !get_bit(block_bitboards[2], g1) && !is_square_attacked(e1, black) && !is_square_attacked(f1, black)){
-                        source_square = e1;
-                        target_square = g1;
-                        add_move(moves_list, encode_move(source_square, target_square, piece, 0, 0, 0, 0, 1)); 
-                    }
-                }
-                if (castling_rights & wq){
-                    if (!get_bit(block_bitboards[2], d1) && !get_bit(block_bitboards[2], c1) && !get_bit(block_bitboards[2], b1) && !is_square_attacked(e1, black) && !is_square_attacked(d1, black)){
-                        source_square = e1;
-                        target_square = c1;
-                        add_move(moves_list, encode_move(source_square, target_square, piece, 0, 0, 0, 0, 1)); 
-                    }
-                }
-            }
-            // Black pawns
-            if (side_to_move == black && piece == p){
-                while (piece_bitboards_copy){
-                    source_square = get_lsb_index(piece_bitboards_copy);
-                    target_square = source_square + 8;
-                    if (target_square >= 0 && target_square < 64 && !get_bit(block_bitboards[2], target_square)){
-                        if (source_square >= a2 && source_square <= h2){
-                            add_move(moves_list, encode_move(source_square, target_square, piece, q, 0, 0, 0, 0));
-                            add_move(moves_list, encode_move(source_square, target_square, piece, r, 0, 0, 0, 0));
-                            add_move(moves_list, encode_move(source_square, target_square, piece, b, 0, 0, 0, 0));
-                            add_move(moves_list, encode_move(source_square, target_square, piece, n, 0, 0, 0, 0));
-                        }
-                        else {
-                            if (!get_bit(block_bitboards[2], target_square)){
-                                add_move(moves_list, encode_move(source_square, target_square, piece, 0, 0, 0, 0, 0));
-                            }
-                            if (source_square >= a7 && source_square <= h7 && !get_bit(block_bitboards[2], target_square + 8)){
-                                add_move(moves_list, encode_move(source_square, target_square + 8, piece, 0, 0, 1, 0, 0));
-                            }
-                        }
-                    }
-                    attacks = pawn_attacks[black][source_square] & block_bitboards[white];
-                    while (attacks){
-                        target_square = get_lsb_index(attacks);
-                        if (source_square >= a2 && source_square <= h2){
-                            add_move(moves_list, encode_move(source_square, target_square, piece, q, 1, 0, 0, 0));
-                            add_move(moves_list, encode_move(source_square, target_square, piece, r, 1, 0, 0, 0));
-                            add_move(moves_list, encode_move(source_square, target_square, piece, b, 1, 0, 0, 0));
-                            add_move(moves_list, encode_move(source_square, target_square, piece, n, 1, 0, 0, 0));                   
-                        }
-                        else {
-                            add_move(moves_list, encode_move(source_square, target_square, piece, 0, 1, 0, 0, 0));
-                        } 
-                        pop_bit(attacks, target_square);
-                    }
+        if (decode_move_castling(move) || decode_move_en_passant(move)){
+            move_list moves_list[1];
+            generate_moves(moves_list, decode_move_castling(move) ? quiet_moves : captures);
+            for (int i = 0; i < moves_list->move_count; i++)
+                if (moves_list->moves[i] == move)
+                    return 1;
+            return 0;
+        }
 
-                    if (en_passant_square != -1){
-                        U64 enpassant_attacks= pawn_attacks[black][source_square] & (1ULL << en_passant_square);
-                        if (enpassant_attacks){
-                            target_square = get_lsb_index(enpassant_attacks);
-                            add_move(moves_list, encode_move(source_square, target_square, piece, 0, 1, 0, 1, 0));   
-                        }
-                    }
-                    pop_bit(piece_bitboards_copy, source_square);
-                }
-            }
-            // Black king castles
-            if (side_to_move == black && piece == k){
-                if (castling_rights & bk){
-                    if (!get_bit(block_bitboards[2], f8) && !get_bit(block_bitboards[2], g8) && !is_square_attacked(e8, black) && !is_square_attacked(f8, white)){
-                        source_square = e8;
-                        target_square = g8;
-                        add_move(moves_list, encode_move(source_square, target_square, piece, 0, 0, 0, 0, 1)); 
-                    }
-                }
-                if (castling_rights & bq){
-                    if (!get_bit(block_bitboards[2], d8) && !get_bit(block_bitboards[2], c8) && !get_bit(block_bitboards[2], b8)&& !is_square_attacked(e8, black) && !is_square_attacked(d8, white)){
-                        source_square = e8;
-                        target_square = c8;
-                        add_move(moves_list, encode_move(source_square, target_square, piece, 0, 0, 0, 0, 1)); 
-                    }
-                }
-            }
-            // Knights
-            if ((side_to_move ==white) ? (piece == N) : (piece == n)){
-                while (piece_bitboards_copy){
-                    source_square = get_lsb_index(piece_bitboards_copy);
-                    attacks = knight_attacks[source_square] & ((side_to_move ==white) ? ~block_bitboards[white] : ~block_bitboards[black]);
-                    while (attacks){
-                        target_square = get_lsb_index(attacks);
-                        if (get_bit(((side_to_move ==white) ? block_bitboards[black] : block_bitboards[white]), target_square)){
-                            add_move(moves_list, encode_move(source_square, target_square, piece, 0, 1, 0, 0, 0));
-                        }
-                        else {
-                            add_move(moves_list, encode_move(source_square, target_square, piece, 0, 0, 0, 0, 0));
-                        }
-                        pop_bit(attacks, target_square);
-                    }
-                    pop_bit(piece_bitboards_copy, source_square);
-                }
-            }
+        if (get_bit(block_bitboards[side_to_move], target_square) || capture != (get_bit(enemy_pieces, target_square) ? 1 : 0))
+            return 0;
 
-            // Bishops
-            if ((side_to_move ==white) ? (piece == B) : (piece == b)){
-                while (piece_bitboards_copy){
-                    source_square = get_lsb_index(piece_bitboards_copy);
-                    attacks = get_bishop_attacks(source_square, block_bitboards[2]) & ((side_to_move ==white) ? ~block_bitboards[white] : ~block_bitboards[black]);
-                    while (attacks){
-                        target_square = get_lsb_index(attacks);
-                        if (!get_bit(((side_to_move ==white) ? block_bitboards[black] : block_bitboards[white]), target_square)){
-                            add_move(moves_list, encode_move(source_square, target_square, piece, 0, 0, 0, 0, 0));
-                        }
-                        else {
-                            add_move(moves_list, encode_move(source_square, target_square, piece, 0, 1, 0, 0, 0));
-                        }
-                        pop_bit(attacks, target_square);
-                    }
-                    pop_bit(piece_bitboards_copy, source_square);
-                }
-            }
-            // Rooks
-            if ((side_to_move ==white) ? (piece == R) : (piece == r)){
-                while (piece_bitboards_copy){
-                    source_square = get_lsb_index(piece_bitboards_copy);
-                    attacks = get_rook_attacks(source_square, block_bitboards[2]) & ((side_to_move ==white) ? ~block_bitboards[white] : ~block_bitboards[black]);
-                    while (attacks){
-                        target_square = get_lsb_index(attacks);
-                        if (!get_bit(((side_to_move ==white) ? block_bitboards[black] : block_bitboards[white]), target_square)){
-                            add_move(moves_list, encode_move(source_square, target_square, piece, 0, 0, 0, 0, 0));
-                        }
-                        else {
-                            add_move(moves_list, encode_move(source_square, target_square, piece, 0, 1, 0, 0, 0));
-                        }
-                        pop_bit(attacks, target_square);
-                    }
-                    pop_bit(piece_bitboards_copy, source_square);
-                }
-            }
-            // Queens
-            if ((side_to_move ==white) ? (piece == Q) : (piece == q)){
-                while (piece_bitboards_copy){
-                    source_square = get_lsb_index(piece_bitboards_copy);
-                    attacks = get_queen_attacks(source_square, block_bitboards[2]) & ((side_to_move ==white) ? ~block_bitboards[white] : ~block_bitboards[black]);
-                    while (attacks){
-                        target_square = get_lsb_index(attacks);
-                        if (!get_bit(((side_to_move ==white) ? block_bitboards[black] : block_bitboards[white]), target_square)){
-                            add_move(moves_list, encode_move(source_square, target_square, piece, 0, 0, 0, 0, 0));
-                        }
-                        else {
-                            add_move(moves_list, encode_move(source_square, target_square, piece, 0, 1, 0, 0, 0));
-                        }
-                        pop_bit(attacks, target_square);
-                    }
-                    pop_bit(piece_bitboards_copy, source_square);
-                }
+        if (piece == P + own){
+            int push = (side_to_move == white) ? -8 : 8;
+            int double_push_rank = (side_to_move == white) ? a2 : a7;
+            if ((target_square < 8 || target_square >= 56) != (promoted_piece != 0))
+                return 0;
+            if (promoted_piece && (promoted_piece < N + own || promoted_piece > Q + own))
+                return 0;
+            if (capture){
+                if (decode_move_double(move) || !get_bit(pawn_attacks[side_to_move][source_square], target_square))
+                    return 0;
             }
-            // Kings
-            if ((side_to_move ==white) ? (piece == K) : (piece == k)){
-                while (piece_bitboards_copy){
-                    source_square = get_lsb_index(piece_bitboards_copy);
-                    attacks = king_attacks[source_square] & ((side_to_move ==white) ? ~block_bitboards[white] : ~block_bitboards[black]);
-                    while (attacks){
-                        target_square = get_lsb_index(attacks);
-                        if (!get_bit(((side_to_move ==white) ? block_bitboards[black] : block_bitboards[white]), target_square)){
-                            add_move(moves_list, encode_move(source_square, target_square, piece, 0, 0, 0, 0, 0));
-                        }
-                        else {
-                            add_move(moves_list, encode_move(source_square, target_square, piece, 0, 1, 0, 0, 0));
-                        }
-                        pop_bit(attacks, target_square);
-                    }
-                    pop_bit(piece_bitboards_copy, source_square);
-                }
+            else if (decode_move_double(move)){
+                if (source_square < double_push_rank || source_square >= double_push_rank + 8 ||
+                    target_square != source_square + 2 * push || get_bit(block_bitboards[2], (source_square + push)))
+                    return 0;
             }
+            else if (target_square != source_square + push)
+                return 0;
         }
-    }
-
-    void init_nnue(char *filename){
-        nnue_init(filename);
-    }
-
-private:
-    U64 piece_keys[12][64];
-    U64 enpassant_keys[64];
-    U64 castle_keys[16];
-    U64 side_key;
-    unsigned int rd_state;
-
-    U64 pawn_attacks[2][64];
-    U64 knight_attacks[64];
-    U64 king_attacks[64];
-    U64 bishop_masks[64];
-    U64 rook_masks[64];
-    U64 bishop_attacks[64][512];
-    U64 rook_attacks[64][4096];
-
-    int killer_moves[2][MAX_PLY];
-    int history_moves[12][MAX_PLY];
-    int pv_length[MAX_PLY];
-    
-    int follow_pv, score_pv;
-    long nodes;
-    int ply;
-
-    typedef struct {
-        U64 hash_key;
-        int depth;
-        int flag;
-        int score;
-    } TT;
-
-    TT hash_table[hash_size];
-
-    int count_bits(U64 bitboard) {
-        int count = 0;
-        while (bitboard) {
-            count++;
-            bitboard &= (bitboard - 1);
-        }
-        return count;
-    }
-
-    int get_lsb_index(U64 bitboard) {
-        if (bitboard) {
-            return count_bits((bitboard & -bitboard) - 1);
+        else {
+            U64 attacks;
+            switch (piece - own){
+                case N: attacks = knight_attacks[source_square]; break;
+                case B: attacks = get_bishop_attacks(source_square, block_bitboards[2]); break;
+                case R: attacks = get_rook_attacks(source_square, block_bitboards[2]); break;
+                case Q: attacks = get_queen_attacks(source_square, block_bitboards[2]); break;
+                default: attacks = king_attacks[source_square]; break;
+            }
+            if (promoted_piece || decode_move_double(move) || !get_bit(attacks, target_square))
+                return 0;
         }
-        else { return -1; }
-    }
-
-    void add_move(move_list *list, int move) {
-        list->moves[list->move_count] = move;
-        list->move_count++;
-    }
-
-    unsigned int get_random_U32_number(){
-        unsigned int x = rd_state;
-        x ^= x << 13;
-        x ^= x >> 17;
-        x ^= x << 5;
-        rd_state = x;
-        return x;
-    }
 
-    U64 get_random_U64_number(){
-        U64 x1, x2, x3, x4;
-        x1 = get_random_U32_number() & 0xFFFF;
-        x2 = get_random_U32_number() & 0xFFFF;
-        x3 = get_random_U32_number() & 0xFFFF;
-        x4 = get_random_U32_number() & 0xFFFF;
-        return x1 | (x2 << 16) | (x3 << 32) | (x4 << 48);
+        // Legal if nothing but a captured piece attacks the king afterwards
+        U64 occupancy = (block_bitboards[2] ^ (1ULL << source_square)) | (1ULL << target_square);
+        int king_square = (piece == K + own) ? target_square : get_lsb_index(piece_bitboards[K + own]);
+        return !(attackers_to(king_square, occupancy) & enemy_pieces & ~(1ULL << target_square));
     }
 
     U64 generate_hash_key(){
@@ -786,747 +1288,1505 @@ private:
         return final_key;
     }
 
-    void init_random_keys(){
-        rd_state = 1804289383;
-
-        for (int piece = P; piece <= k; piece++){
-            for (int square = 0; square < 64; square++)
-                piece_keys[piece][square] = get_random_U64_number();
-        }
-        
-        for (int square = 0; square < 64; square++)
-            enpassant_keys[square] = get_random_U64_number();
-        
-        for (int index = 0; index < 16; index++)
-            castle_keys[index] = get_random_U64_number();
-            
-        side_key = get_random_U64_number();
+    void revert_move(UndoInfo info) {
+        PROFILE_SCOPE(profile_revert_move);
+        if (side_to_move == white)
+            revert_move<black>(info);
+        else
+            revert_move<white>(info);
     }
 
-    U64 mask_pawn_attacks(int color, int square){
-        U64 attacks = 0ULL;
-        U64 bitboard = 0ULL;
-        set_bit(bitboard, square);
-        if (color == white){
-            if ((bitboard >> 7) & not_a_file){attacks |= (bitboard >> 7);}
-            if ((bitboard >> 9) & not_h_file){attacks |= (bitboard >> 9);}
-
-        } else {
-            if ((bitboard << 9) & not_a_file){attacks |= (bitboard << 9);}
-            if ((bitboard << 7) & not_h_file){attacks |= (bitboard << 7);}
-        }
-        return attacks;
+    // Moves from generate_moves are always legal; check_legality is only
+    // needed for moves from elsewhere, which are taken back and 0 returned
+    // when they leave the king in check
+    int apply_move(int move, int only_capture_flag, UndoInfo* undo, DirtyPiece *dirty_piece = NULL, int check_legality = 0) {
+        PROFILE_SCOPE(profile_apply_move);
+        if (only_capture_flag && !decode_move_capture(move))
+            return 0;
+        if (side_to_move == white)
+            return apply_move<white>(move, undo, dirty_piece, check_legality);
+        return apply_move<black>(move, undo, dirty_piece, check_legality);
     }
 
-    U64 mask_knight_attacks(int square){
-        U64 attacks = 0ULL;
-        U64 bitboard = 0ULL;
-        set_bit(bitboard, square);
-
-        if ((bitboard >> 17) & not_h_file){attacks |= (bitboard >> 17);}
-        if ((bitboard >> 15) & not_a_file){attacks |= (bitboard >> 15);}
-        if ((bitboard >> 10) & not_hg_file){attacks |= (bitboard >> 10);}
-        if ((bitboard >> 6 ) & not_ab_file){attacks |= (bitboard >> 6);}
+    U64 get_bishop_attacks(int square, U64 block){
+        return slider_lookup(&bishop_tables[square], block);
+    }
 
-        if ((bitboard << 17) & not_a_file){attacks |= (bitboard << 17);}
-        if ((bitboard << 15) & not_h_file){attacks |= (bitboard << 15);}
-        if ((bitboard << 10) & not_ab_file){attacks |= (bitboard << 10);}
-        if ((bitboard << 6 ) & not_hg_file){attacks |= (bitboard << 6);}
-        return attacks;
+    U64 get_rook_attacks(int square, U64 block){
+        return slider_lookup(&rook_tables[square], block);
     }
 
-    U64 mask_king_attacks(int square){
-        U64 attacks = 0ULL;
-        U64 bitboard = 0ULL;
-        set_bit(bitboard, square);
+    U64 get_queen_attacks(int square, U64 block){
+        return slider_lookup(&bishop_tables[square], block) | slider_lookup(&rook_tables[square], block);
+    }
 
-        if ((bitboard >> 7) & not_a_file){attacks |= (bitboard >> 7);}
-        if ((bitboard >> 8)){attacks |= (bitboard >> 8);}
-        if ((bitboard >> 9) & not_h_file){attacks |= (bitboard >> 9);}
+    int is_square_attacked(int square, int side){
+        PROFILE_SCOPE(profile_is_square_attacked);
+        if (side == white)
+            return is_square_attacked<white>(square);
+        return is_square_attacked<black>(square);
+    }
 
-        if ((bitboard << 7) & not_h_file){attacks |= (bitboard << 7);}
-        if ((bitboard << 8)){attacks |= (bitboard << 8);}
-        if ((bitboard << 9) & not_a_file){attacks |= (bitboard << 9);}
-        
-        if ((bitboard >> 1) & not_h_file){attacks |= (bitboard >> 1);}
-        if ((bitboard << 1) & not_a_file){attacks |= (bitboard << 1);}
-        return attacks;
+    // Pieces of both sides attacking a square, sliders seeing through
+    // everything not in occupancy
+    U64 attackers_to(int square, U64 occupancy){
+        return (pawn_attacks[black][square] & piece_bitboards[P])
+             | (pawn_attacks[white][square] & piece_bitboards[p])
+             | (knight_attacks[square] & (piece_bitboards[N] | piece_bitboards[n]))
+             | (king_attacks[square] & (piece_bitboards[K] | piece_bitboards[k]))
+             | (get_bishop_attacks(square, occupancy) & (piece_bitboards[B] | piece_bitboards[b] | piece_bitboards[Q] | piece_bitboards[q]))
+             | (get_rook_attacks(square, occupancy) & (piece_bitboards[R] | piece_bitboards[r] | piece_bitboards[Q] | piece_bitboards[q]));
     }
 
-    U64 mask_bishop_attacks(int square){
-        U64 attacks = 0ULL;
-        int tr = square/8, tf = square%8;
+    // Static exchange evaluation: material won by move once both sides have
+    // recaptured on its target square with their least valuable piece for
+    // as long as it pays. Pins are ignored; pieces behind a capturer join in
+    // as it leaves.
+    int see(int move){
+        int source_square = decode_move_source(move);
+        int target_square = decode_move_target(move);
+        int promotion = decode_move_promotion(move);
+        U64 occupancy = block_bitboards[2] ^ (1ULL << source_square);
+        int gain[32];
 
-        for (int r=tr+1, f = tf+1; r < 7 && f < 7; r++, f++){
-            attacks |= (1ULL << (r*8 + f));
+        if (decode_move_en_passant(move)) {
+            gain[0] = see_values[P];
+            occupancy ^= 1ULL << (target_square + (side_to_move == white ? 8 : -8));
         }
-        for (int r=tr+1, f = tf-1; r < 7 && f >= 1; r++, f--){
-            attacks |= (1ULL << (r*8 + f));
+        else
+            gain[0] = (board[target_square] == -1) ? 0 : see_values[board[target_square]];
+
+        int on_square = decode_move_piece(move);
+        if (promotion) {
+            gain[0] += see_values[promotion] - see_values[P];
+            on_square = promotion;
         }
-        for (int r=tr-1, f = tf+1; r >= 1 && f < 7; r--, f++){
-            attacks |= (1ULL << (r*8 + f));
+
+        U64 attackers = attackers_to(target_square, occupancy) & occupancy;
+        U64 diagonal = piece_bitboards[B] | piece_bitboards[b] | piece_bitboards[Q] | piece_bitboards[q];
+        U64 straight = piece_bitboards[R] | piece_bitboards[r] | piece_bitboards[Q] | piece_bitboards[q];
+        int side = side_to_move ^ 1;
+        int depth = 0;
+
+        while (depth < 31) {
+            U64 side_attackers = attackers & block_bitboards[side];
+            if (!side_attackers)
+                break;
+
+            int piece = (side == white) ? P : p;
+            while (!(side_attackers & piece_bitboards[piece]))
+                piece++;
+
+            depth++;
+            gain[depth] = see_values[on_square] - gain[depth - 1];
+
+            occupancy ^= (side_attackers & piece_bitboards[piece]) & -(side_attackers & piece_bitboards[piece]);
+            if (piece == P || piece == p || piece == B || piece == b || piece == Q || piece == q)
+                attackers |= get_bishop_attacks(target_square, occupancy) & diagonal;
+            if (piece == R || piece == r || piece == Q || piece == q)
+                attackers |= get_rook_attacks(target_square, occupancy) & straight;
+            attackers &= occupancy;
+            on_square = piece;
+            side ^= 1;
         }
-        for (int r=tr-1, f = tf-1; r >= 1 && f >= 1; r--, f--){
-            attacks |= (1ULL << (r*8 + f));
+
+        while (depth) {
+            if (gain[depth] > -gain[depth - 1])
+                gain[depth - 1] = -gain[depth];
+            depth--;
         }
-        return attacks;
+        return gain[0];
     }
 
-    U64 bishop_attacks_otf(int square, U64 block){
-        U64 attacks = 0ULL;
-        int r, f;
-        int tr = square / 8;
-        int tf = square % 8;
-        
-        for (r = tr + 1, f = tf + 1; r <= 7 && f <= 7; r++, f++){
-            attacks |= (1ULL << (r * 8 + f));
-            if ((1ULL << (r * 8 + f)) & block) break;
-        }
-        
-        for (r = tr - 1, f = tf + 1; r >= 0 && f <= 7; r--, f++){
-            attacks |= (1ULL << (r * 8 + f));
-            if ((1ULL << (r * 8 + f)) & block) break;
-        }
-        
-        for (r = tr + 1, f = tf - 1; r <= 7 && f >= 0; r++, f--){
-            attacks |= (1ULL << (r * 8 + f));
-            if ((1ULL << (r * 8 + f)) & block) break;
-        }
-        
-        for (r = tr - 1, f = tf - 1; r >= 0 && f >= 0; r--, f--){
-            attacks |= (1ULL << (r * 8 + f));
-            if ((1ULL << (r * 8 + f)) & block) break;
+    // Pieces and squares in the input format of the NNUE evaluation
+    void nnue_input(int *pieces, int *squares) {
+        U64 bitboard;
+        int piece, square;
+        int index = 2;
+
+        for (int bb_piece = P; bb_piece <= k; bb_piece++) {
+            bitboard = piece_bitboards[bb_piece];
+            while (bitboard) {
+                piece = bb_piece;
+                
+                square = get_lsb_index(bitboard);
+                
+                if (piece == K) {
+                    pieces[0] = nnue_pieces[piece];
+                    squares[0] = nnue_squares[square];
+                }
+                
+                else if (piece == k) {
+                    pieces[1] = nnue_pieces[piece];
+                    squares[1] = nnue_squares[square];
+                }
+                
+                else {
+                    pieces[index] = nnue_pieces[piece];
+                    squares[index] = nnue_squares[square];
+                    index++;    
+                }
+
+                pop_bit(bitboard, square);
+            }
         }
         
-        return attacks;
+        pieces[index] = 0;
+        squares[index] = 0;
     }
 
-    U64 mask_rook_attacks(int square){
-        U64 attacks = 0ULL;
-        int tr = square/8, tf = square%8;
+private:
+    void add_move(move_list *list, int move) {
+        list->moves[list->move_count] = move;
+        list->move_count++;
+    }
 
-        for (int r=tr+1; r<7; r++){
-            attacks |= (1ULL << (r*8 + tf));
-        }
-        for (int r=tr-1; r>=1; r--){
-            attacks |= (1ULL << (r*8 + tf));
-        }
-        for (int f=tf+1; f<7; f++){
-            attacks |= (1ULL << (tr*8 + f));
-        }
-        for (int f=tf-1; f>=1; f--){
-            attacks |= (1ULL << (tr*8 + f));
+    void add_pawn_move(move_list *list, int source_square, int target_square, int piece, int capture) {
+        if (target_square < 8 || target_square >= 56) {
+            int queen = (piece == P) ? Q : q;
+            for (int promoted_piece = queen; promoted_piece > piece; promoted_piece--)
+                add_move(list, encode_move(source_square, target_square, piece, promoted_piece, capture, 0, 0, 0));
         }
-        return attacks;
+        else
+            add_move(list, encode_move(source_square, target_square, piece, 0, capture, 0, 0, 0));
+    }
+
+    // En passant takes two pieces off the board at once, which the pin masks
+    // don't cover, so look at the king in the position after the capture
+    int is_en_passant_legal(int source_square, int king_square) {
+        int captured_square = en_passant_square + (side_to_move == white ? 8 : -8);
+        U64 occupancy = (block_bitboards[2] ^ (1ULL << source_square) ^ (1ULL << captured_square)) | (1ULL << en_passant_square);
+        U64 enemy_pieces = block_bitboards[side_to_move ^ 1] ^ (1ULL << captured_square);
+        return !(attackers_to(king_square, occupancy) & enemy_pieces);
     }
 
-    U64 rook_attacks_otf(int square, U64 blocking_pieces){
-        U64 attacks = 0ULL;
-        int tr = square/8, tf = square%8;
+    void add_dirty_piece(DirtyPiece *dp, int piece, int from, int to) {
+        dp->pc[dp->dirtyNum] = nnue_pieces[piece];
+        dp->from[dp->dirtyNum] = from == -1 ? 64 : nnue_squares[from];
+        dp->to[dp->dirtyNum] = to == -1 ? 64 : nnue_squares[to];
+        dp->dirtyNum++;
+    }
+
+    // Side-specific code is compiled once for each colour, so the inner
+    // loops don't test side_to_move; the public functions pick the colour
+    template <int Us>
+    static U64 pawn_pushes(U64 pawns) {
+        return (Us == white) ? pawns >> 8 : pawns << 8;
+    }
 
-        for (int r=tr+1; r<=7; r++){
-            attacks |= (1ULL << (r*8 + tf));
-            if ((1ULL << (r*8 + tf)) & blocking_pieces){break;}
+    template <int Us>
+    void generate_moves(move_list* moves_list, int move_type){
+        const int Them = Us ^ 1;
+        const int own = (Us == white) ? P : p;
+        const int enemy = (Us == white) ? p : P;
+        const int push = (Us == white) ? -8 : 8;
+        // Single pushes landing here can be pushed again
+        const U64 double_push_rank = (Us == white) ? 0x0000ff0000000000ULL : 0x0000000000ff0000ULL;
+
+        moves_list->move_count = 0;
+        int source_square, target_square;
+        U64 bitboard, attacks;
+
+        int king_square = get_lsb_index(piece_bitboards[K + own]);
+        U64 own_pieces = block_bitboards[Us];
+        U64 enemy_pieces = block_bitboards[Them];
+        U64 empty = ~block_bitboards[2];
+        U64 checkers = attackers_to(king_square, block_bitboards[2]) & enemy_pieces;
+        U64 targets = ~own_pieces;
+        if (move_type == captures)
+            targets = enemy_pieces;
+        else if (move_type == quiet_moves)
+            targets = empty;
+
+        // Squares the other pieces may move to: anywhere when not in check, the
+        // checker or a square in between in single check, nowhere in double check
+        U64 check_mask = ~0ULL;
+        if (checkers)
+            check_mask = (checkers & (checkers - 1)) ? 0ULL : checkers | between_squares[king_square][get_lsb_index(checkers)];
+
+        // A piece alone between the king and an enemy slider can only move
+        // along that line
+        U64 pinned = 0ULL;
+        U64 pin_rays[64];
+        U64 snipers = (get_rook_attacks(king_square, 0ULL) & (piece_bitboards[R + enemy] | piece_bitboards[Q + enemy]))
+                    | (get_bishop_attacks(king_square, 0ULL) & (piece_bitboards[B + enemy] | piece_bitboards[Q + enemy]));
+        while (snipers){
+            int sniper_square = get_lsb_index(snipers);
+            U64 blockers = between_squares[king_square][sniper_square] & block_bitboards[2];
+            if (blockers && !(blockers & (blockers - 1)) && (blockers & own_pieces)){
+                pinned |= blockers;
+                pin_rays[get_lsb_index(blockers)] = between_squares[king_square][sniper_square] | (1ULL << sniper_square);
+            }
+            pop_bit(snipers, sniper_square);
         }
-        for (int r=tr-1; r>=0; r--){
-            attacks |= (1ULL << (r*8 + tf));
-            if ((1ULL << (r*8 + tf)) & blocking_pieces){break;}
 
+        if (check_mask){
+            // Pawns that aren't pinned, all at once by shifting the bitboard
+            U64 pawns = piece_bitboards[P + own] & ~pinned;
+            if (move_type != captures){
+                U64 single_pushes = pawn_pushes<Us>(pawns) & empty;
+                U64 double_pushes = pawn_pushes<Us>(single_pushes & double_push_rank) & empty & check_mask;
+                single_pushes &= check_mask;
+                while (single_pushes){
+                    target_square = get_lsb_index(single_pushes);
+                    add_pawn_move(moves_list, target_square - push, target_square, P + own, 0);
+                    pop_bit(single_pushes, target_square);
+                }
+                while (double_pushes){
+                    target_square = get_lsb_index(double_pushes);
+                    add_move(moves_list, encode_move(target_square - 2 * push, target_square, P + own, 0, 0, 1, 0, 0));
+                    pop_bit(double_pushes, target_square);
+                }
+            }
+            if (move_type != quiet_moves){
+                // Towards the a file, then towards the h file
+                U64 west_captures = ((Us == white) ? (pawns >> 9) & not_h_file : (pawns << 7) & not_h_file) & enemy_pieces & check_mask;
+                U64 east_captures = ((Us == white) ? (pawns >> 7) & not_a_file : (pawns << 9) & not_a_file) & enemy_pieces & check_mask;
+                while (west_captures){
+                    target_square = get_lsb_index(west_captures);
+                    add_pawn_move(moves_list, target_square - push + 1, target_square, P + own, 1);
+                    pop_bit(west_captures, target_square);
+                }
+                while (east_captures){
+                    target_square = get_lsb_index(east_captures);
+                    add_pawn_move(moves_list, target_square - push - 1, target_square, P + own, 1);
+                    pop_bit(east_captures, target_square);
+                }
+                if (en_passant_square != -1){
+                    bitboard = pawn_attacks[Them][en_passant_square] & piece_bitboards[P + own];
+                    while (bitboard){
+                        source_square = get_lsb_index(bitboard);
+                        if (is_en_passant_legal(source_square, king_square))
+                            add_move(moves_list, encode_move(source_square, en_passant_square, P + own, 0, 1, 0, 1, 0));
+                        pop_bit(bitboard, source_square);
+                    }
+                }
+            }
+
+            // Pinned pawns, one by one along their pin ray
+            bitboard = piece_bitboards[P + own] & pinned;
+            while (bitboard){
+                source_square = get_lsb_index(bitboard);
+                U64 allowed = check_mask & pin_rays[source_square];
+                target_square = source_square + push;
+                if (move_type != captures && get_bit(empty, target_square)){
+                    if (get_bit(allowed, target_square))
+                        add_pawn_move(moves_list, source_square, target_square, P + own, 0);
+                    if (get_bit(double_push_rank, target_square)){
+                        int double_push_square = target_square + push;
+                        if (get_bit(empty, double_push_square) && get_bit(allowed, double_push_square))
+                            add_move(moves_list, encode_move(source_square, double_push_square, P + own, 0, 0, 1, 0, 0));
+                    }
+                }
+                if (move_type != quiet_moves){
+                    attacks = pawn_attacks[Us][source_square] & enemy_pieces & allowed;
+                    while (attacks){
+                        target_square = get_lsb_index(attacks);
+                        add_pawn_move(moves_list, source_square, target_square, P + own, 1);
+                        pop_bit(attacks, target_square);
+                    }
+                }
+                pop_bit(bitboard, source_square);
+            }
+
+            // Knights, bishops, rooks and queens
+            for (int piece = N + own; piece <= Q + own; piece++){
+                bitboard = piece_bitboards[piece];
+                while (bitboard){
+                    source_square = get_lsb_index(bitboard);
+                    switch (piece - own){
+                        case N: attacks = knight_attacks[source_square]; break;
+                        case B: attacks = get_bishop_attacks(source_square, block_bitboards[2]); break;
+                        case R: attacks = get_rook_attacks(source_square, block_bitboards[2]); break;
+                        default: attacks = get_queen_attacks(source_square, block_bitboards[2]); break;
+                    }
+                    attacks &= targets & check_mask;
+                    if (get_bit(pinned, source_square))
+                        attacks &= pin_rays[source_square];
+                    while (attacks){
+                        target_square = get_lsb_index(attacks);
+                        add_move(moves_list, encode_move(source_square, target_square, piece, 0, get_bit(enemy_pieces, target_square) ? 1 : 0, 0, 0, 0));
+                        pop_bit(attacks, target_square);
+                    }
+                    pop_bit(bitboard, source_square);
+                }
+            }
         }
-        for (int f=tf+1; f<=7; f++){
-            attacks |= (1ULL << (tr*8 + f));
-            if ((1ULL << (tr*8 + f)) & blocking_pieces){break;}
+
+        // Castles
+        if (move_type != captures && !checkers){
+            const int king_side = (Us == white) ? wk : bk;
+            const int queen_side = (Us == white) ? wq : bq;
+            const int e = (Us == white) ? e1 : e8;
+            if ((castling_rights & king_side) && !get_bit(block_bitboards[2], e + 1) && !get_bit(block_bitboards[2], e + 2) &&
+                !is_square_attacked<Them>(e + 1) && !is_square_attacked<Them>(e + 2))
+                add_move(moves_list, encode_move(e, e + 2, K + own, 0, 0, 0, 0, 1));
+            if ((castling_rights & queen_side) && !get_bit(block_bitboards[2], e - 1) && !get_bit(block_bitboards[2], e - 2) && !get_bit(block_bitboards[2], e - 3) &&
+                !is_square_attacked<Them>(e - 1) && !is_square_attacked<Them>(e - 2))
+                add_move(moves_list, encode_move(e, e - 2, K + own, 0, 0, 0, 0, 1));
         }
-        for (int f=tf-1; f>=0; f--){
-            attacks |= (1ULL << (tr*8 + f));
-            if ((1ULL << (tr*8 + f)) & blocking_pieces){break;}
 
+        // King, looking through its own square so it can't step back along
+        // the line of a checking slider
+        U64 occupancy = block_bitboards[2] ^ (1ULL << king_square);
+        attacks = king_attacks[king_square] & targets;
+        while (attacks){
+            target_square = get_lsb_index(attacks);
+            if (!(attackers_to(target_square, occupancy) & enemy_pieces))
+                add_move(moves_list, encode_move(king_square, target_square, K + own, 0, get_bit(enemy_pieces, target_square) ? 1 : 0, 0, 0, 0));
+            pop_bit(attacks, target_square);
         }
-        return attacks;
     }
 
-    U64 set_block(int index, int n_bits_in_mask, U64 attack_mask){
-        U64 block = 0ULL;
-        for (int i = 0; i < n_bits_in_mask; i++){
-            int square = get_lsb_index(attack_mask);
-            pop_bit(attack_mask, square);
-            if (index & (1 << i)) {
-                set_bit(block, square);
-            }
+    template <int Us>
+    int apply_move(int move, UndoInfo* undo, DirtyPiece *dirty_piece, int check_legality) {
+        const int Them = Us ^ 1;
+        const int own = (Us == white) ? P : p;
+        const int push = (Us == white) ? -8 : 8;
+
+        int source_square = decode_move_source(move);
+        int target_square = decode_move_target(move);
+        int piece = decode_move_piece(move);
+        int promoted_piece = decode_move_promotion(move);
+        int capture = decode_move_capture(move);
+        int double_push = decode_move_double(move);
+        int en_passant = decode_move_en_passant(move);
+        int castling = decode_move_castling(move);
+        int captured_square = en_passant ? target_square - push : target_square;
+        // The rook of a castle goes next to the king, on the side it came from
+        int rook_source = (target_square > source_square) ? target_square + 1 : target_square - 2;
+        int rook_target = (target_square > source_square) ? target_square - 1 : target_square + 1;
+
+        // Save undo info
+        undo->move              = move;
+        undo->fifty             = fifty;
+        undo->castling_rights   = castling_rights;
+        undo->en_passant_square = en_passant_square;
+        undo->hash_key          = hash_key;
+        undo->captured_piece    = capture ? board[captured_square] : -1;
+
+        // Record the changed pieces for the NNUE accumulator, moving piece first
+        if (dirty_piece) {
+            add_dirty_piece(dirty_piece, piece, source_square, promoted_piece ? -1 : target_square);
+            if (capture)
+                add_dirty_piece(dirty_piece, undo->captured_piece, captured_square, -1);
+            if (promoted_piece)
+                add_dirty_piece(dirty_piece, promoted_piece, -1, target_square);
+            if (castling)
+                add_dirty_piece(dirty_piece, R + own, rook_source, rook_target);
         }
-        return block;
-    }
 
-    void init_all(){
-        init_random_keys();
+        // move piece
+        U64 source_target = (1ULL << source_square) | (1ULL << target_square);
+        piece_bitboards[piece] ^= source_target;
+        block_bitboards[Us] ^= source_target;
+        board[source_square] = -1;
+        board[target_square] = promoted_piece ? promoted_piece : piece;
+        hash_key ^= piece_keys[piece][source_square]; // remove piece from source square in hash key
+        hash_key ^= piece_keys[piece][target_square]; // set piece to the target square in hash key
 
-        for (int color = 0; color < 2; color++){
-            for (int square = 0; square < 64; square++){
-                pawn_attacks[color][square] = mask_pawn_attacks(color, square);
-            }
+        fifty++;
+
+        if (piece == P + own)
+            fifty = 0;
+
+        if (capture) {
+            fifty = 0;
+            piece_bitboards[undo->captured_piece] ^= 1ULL << captured_square;
+            block_bitboards[Them] ^= 1ULL << captured_square;
+            hash_key ^= piece_keys[undo->captured_piece][captured_square];
+            if (en_passant)
+                board[captured_square] = -1;
         }
-        
-        for (int square = 0; square < 64; square++){
-            knight_attacks[square] = mask_knight_attacks(square);
-            king_attacks[square] = mask_king_attacks(square);
+
+        if (promoted_piece) {
+            // swap the pawn on the target square for the new piece
+            piece_bitboards[P + own] ^= 1ULL << target_square;
+            piece_bitboards[promoted_piece] ^= 1ULL << target_square;
+            hash_key ^= piece_keys[P + own][target_square];
+            hash_key ^= piece_keys[promoted_piece][target_square];
         }
 
-        for (int square = 0; square < 64; square++){
-            bishop_masks[square] = mask_bishop_attacks(square);
-            U64 attack_mask = bishop_masks[square];
-            int relevant_bits = count_bits(attack_mask);
-            int block_indicies = 1 << relevant_bits;
-
-            for (int i = 0; i < block_indicies; i++){
-                U64 block = set_block(i, relevant_bits, attack_mask);
-                int magic_index = (int)((block * bishop_magic[square]) >> (64 - bishop_rel_bits[square]));
-                bishop_attacks[square][magic_index] = bishop_attacks_otf(square, block);
-            }
+        if (en_passant_square != -1) hash_key ^= enpassant_keys[en_passant_square];
+
+        en_passant_square = -1;
+
+        if (double_push) {
+            en_passant_square = target_square - push;
+            hash_key ^= enpassant_keys[en_passant_square];
         }
 
-        for (int square = 0; square < 64; square++){
-            rook_masks[square] = mask_rook_attacks(square);
-            U64 attack_mask = rook_masks[square];
-            int relevant_bits = count_bits(attack_mask);
-            int block_indicies = 1 << relevant_bits;
-
-            for (int i = 0; i < block_indicies; i++){
-                U64 block = set_block(i, relevant_bits, attack_mask);
-                int magic_index = (int)((block * rook_magic[square]) >> (64 - rook_rel_bits[square]));
-                rook_attacks[square][magic_index] = rook_attacks_otf(square, block);
-            }
+        if (castling) {
+            U64 rook_source_target = (1ULL << rook_source) | (1ULL << rook_target);
+            piece_bitboards[R + own] ^= rook_source_target;
+            block_bitboards[Us] ^= rook_source_target;
+            board[rook_source] = -1;
+            board[rook_target] = R + own;
+            hash_key ^= piece_keys[R + own][rook_source];
+            hash_key ^= piece_keys[R + own][rook_target];
         }
+
+        hash_key ^= castle_keys[castling_rights];
+        castling_rights &= castling_rights_sq[source_square];
+        castling_rights &= castling_rights_sq[target_square];
+        hash_key ^= castle_keys[castling_rights];
+
+        block_bitboards[2] = block_bitboards[white] | block_bitboards[black];
+
+        side_to_move = Them;
+
+        hash_key ^= side_key;
+
+        if (check_legality && is_square_attacked<Them>(get_lsb_index(piece_bitboards[K + own]))) {
+            revert_move<Us>(*undo);
+            return 0;
+        }
+        return 1;
     }
 
-    void revert_move(UndoInfo info) {
-        int move      = info.move;
-        int source    = decode_move_source(move);
-        int target    = decode_move_target(move);
-        int piece     = decode_move_piece(move);
-        int promotion = decode_move_promotion(move);
-        int capture   = decode_move_capture(move);
+    // Take back a move played by Us
+    template <int Us>
+    void revert_move(const UndoInfo &info) {
+        const int Them = Us ^ 1;
+        const int own = (Us == white) ? P : p;
+        const int push = (Us == white) ? -8 : 8;
+
+        int move       = info.move;
+        int source     = decode_move_source(move);
+        int target     = decode_move_target(move);
+        int piece      = decode_move_piece(move);
+        int promotion  = decode_move_promotion(move);
+        int capture    = decode_move_capture(move);
         int en_passant = decode_move_en_passant(move);
         int castling   = decode_move_castling(move);
-        int pawn       = (side_to_move == white ? P : p);
 
-        side_to_move ^= 1;
+        side_to_move = Us;
         hash_key = info.hash_key;
         en_passant_square = info.en_passant_square;
         castling_rights = info.castling_rights;
         fifty = info.fifty;
-        
 
         // Undo piece move
+        assert(get_bit(piece_bitboards[promotion ? promotion : piece], target));
         if (promotion) {
-            if (!get_bit(piece_bitboards[promotion], target)) {
-                print_board();
-                print_move(move);
-                std::cout << "No piece at target square" << std::endl;
-                exit(1);
-            }
-            pop_bit(piece_bitboards[promotion], target);
-            set_bit(piece_bitboards[(side_to_move == white ? P : p)], source);
-        } 
-        else {
-            if (!get_bit(piece_bitboards[piece], target)) {
-                print_board();
-                print_move(move);
-                std::cout << "No piece at target square" << std::endl;
-                exit(1);
-            }
-            pop_bit(piece_bitboards[piece], target);
-            set_bit(piece_bitboards[piece], source);
+            piece_bitboards[promotion] ^= 1ULL << target;
+            piece_bitboards[P + own] ^= 1ULL << source;
         }
+        else
+            piece_bitboards[piece] ^= (1ULL << source) | (1ULL << target);
+        block_bitboards[Us] ^= (1ULL << source) | (1ULL << target);
+        board[source] = piece;
+        board[target] = -1;
 
         // Restore captured piece
         if (capture) {
-            if (en_passant) {
-                int sq = (side_to_move == white) ? target + 8 : target - 8;
-                set_bit(piece_bitboards[(side_to_move == white) ? p : P], sq);
-            } else {
-                set_bit(piece_bitboards[info.captured_piece], target);
-            }
+            int captured_square = en_passant ? target - push : target;
+            piece_bitboards[info.captured_piece] ^= 1ULL << captured_square;
+            block_bitboards[Them] ^= 1ULL << captured_square;
+            board[captured_square] = info.captured_piece;
         }
 
         // Undo castling
         if (castling) {
-            if (side_to_move == white) {
-                if (target == c1) {
-                    pop_bit(piece_bitboards[R], d1);
-                    set_bit(piece_bitboards[R], a1);
-                } else {
-                    pop_bit(piece_bitboards[R], f1);
-                    set_bit(piece_bitboards[R], h1);
-                }
-            } else {
-                if (target == c8) {
-                    pop_bit(piece_bitboards[r], d8);
-                    set_bit(piece_bitboards[r], a8);
-                } else {
-                    pop_bit(piece_bitboards[r], f8);
-                    set_bit(piece_bitboards[r], h8);
-                }
-            }
+            int rook_source = (target > source) ? target + 1 : target - 2;
+            int rook_target = (target > source) ? target - 1 : target + 1;
+            U64 rook_source_target = (1ULL << rook_source) | (1ULL << rook_target);
+            piece_bitboards[R + own] ^= rook_source_target;
+            block_bitboards[Us] ^= rook_source_target;
+            board[rook_target] = -1;
+            board[rook_source] = R + own;
         }
-        
-        memset(block_bitboards, 0ULL, 24);
-        for (int i = P; i <= K; i++) block_bitboards[white] |= piece_bitboards[i];
-        for (int i = p; i <= k; i++) block_bitboards[black] |= piece_bitboards[i];
+
         block_bitboards[2] = block_bitboards[white] | block_bitboards[black];
     }
 
-    int apply_move(int move, int only_capture_flag, UndoInfo* undo) {
-        if (!only_capture_flag){ 
-            int source_square = decode_move_source(move);
-            int target_square = decode_move_target(move);
-            int piece = decode_move_piece(move);
-            int promoted_piece = decode_move_promotion(move);
-            int capture = decode_move_capture(move);
-            int double_push = decode_move_double(move);
-            int en_passant = decode_move_en_passant(move);
-            int castling = decode_move_castling(move);
-
-            // Save undo info
-            undo->move              = move;
-            undo->fifty             = fifty;
-            undo->castling_rights   = castling_rights;
-            undo->en_passant_square = en_passant_square;
-            undo->hash_key          = hash_key;
-            undo->captured_piece    = -1;
-            
-            if (capture) {
-                int captured_square = en_passant
-                    ? (side_to_move == white ? target_square + 8 : target_square - 8)
-                    : target_square;
-
-                int start = (side_to_move == white ? p : P);
-                int end   = (side_to_move == white ? k : K);
-
-                for (int i = start; i <= end; i++) {
-                    if (get_bit(piece_bitboards[i], captured_square)) {
-                        undo->captured_piece = i;
-                        break;
-                    }
-                }
+    // Whether side Them attacks a square
+    template <int Them>
+    int is_square_attacked(int square){
+        const int their = (Them == white) ? P : p;
+        return (pawn_attacks[Them ^ 1][square] & piece_bitboards[P + their])
+            || (knight_attacks[square] & piece_bitboards[N + their])
+            || (king_attacks[square] & piece_bitboards[K + their])
+            || (get_bishop_attacks(square, block_bitboards[2]) & (piece_bitboards[B + their] | piece_bitboards[Q + their]))
+            || (get_rook_attacks(square, block_bitboards[2]) & (piece_bitboards[R + their] | piece_bitboards[Q + their]));
+    }
+};
+
+// Transposition table: a power of two of 64-byte buckets, each holding four
+// 16-byte entries in a single cache line. The low bits of the hash key pick
+// the bucket and its top 16 bits tell the entries apart. When a bucket is
+// full, the entry searched least deep is replaced, entries left by earlier
+// searches counting as shallower the older they are.
+//
+// Search threads share the table without locking: an entry is two words
+// written separately, the key being stored xor-ed with a fold of the other
+// word so that an entry torn by two threads writing at once doesn't match.
+class TranspositionTable {
+public:
+    struct Entry {
+        int eval;
+        int depth;
+        int flag;
+        int score;
+        int move;
+    };
+
+    TranspositionTable(size_t size_mb) {
+        resize(size_mb);
+    }
+
+    // Size in MB, rounded down to a power of two buckets; clears the table
+    void resize(size_t size_mb) {
+        size_t count = 1;
+        while (count * 2 * sizeof(Bucket) <= size_mb * 1024 * 1024)
+            count *= 2;
+        buckets.reset(new Bucket[count]);
+        mask = count - 1;
+        clear();
+    }
+
+    void clear() {
+        for (size_t i = 0; i <= mask; i++) {
+            for (int j = 0; j < BUCKET_ENTRIES; j++) {
+                buckets[i].slots[j].info.store(0, std::memory_order_relaxed);
+                buckets[i].slots[j].data.store(0, std::memory_order_relaxed);
             }
+        }
+        generation = 0;
+    }
 
-            // move piece
-            pop_bit(piece_bitboards[piece], source_square);
-            set_bit(piece_bitboards[piece], target_square);
-            hash_key ^= piece_keys[piece][source_square]; // remove piece from source square in hash key
-            hash_key ^= piece_keys[piece][target_square]; // set piece to the target square in hash key
-            
-            fifty++;
-            
-            if (piece == P || piece == p)
-                fifty = 0;
-            
-            if (capture) {
-                fifty = 0;
-
-                int start = (side_to_move == white ? p : P);
-                int end   = (side_to_move == white ? k : K);
-                
-                for (int bb_piece = start; bb_piece <= end; bb_piece++){
-                    if (get_bit(piece_bitboards[bb_piece], target_square)){
-                        pop_bit(piece_bitboards[bb_piece], target_square);
-                        hash_key ^= piece_keys[bb_piece][target_square];
-                        break;
-                    }
-                }
+    size_t size_mb() const {
+        return (mask + 1) * sizeof(Bucket) / (1024 * 1024);
+    }
+
+    // Called before each search, so that the entries of older ones age
+    void new_search() {
+        generation = (generation + 1) & 63;
+    }
+
+    int probe(U64 hash_key, Entry *entry) {
+        Slot *slots = buckets[hash_key & mask].slots;
+        for (int i = 0; i < BUCKET_ENTRIES; i++) {
+            U64 info = slots[i].info.load(std::memory_order_relaxed);
+            U64 data = slots[i].data.load(std::memory_order_relaxed);
+            if (info_generation_flag(info) && info_key(info, data) == slot_key(hash_key)) {
+                entry->eval = (int16_t)(info >> 16);
+                entry->depth = (int)(data >> 56);
+                entry->flag = (info_generation_flag(info) & 3) - 1;
+                entry->score = (int32_t)data;
+                entry->move = (int)((data >> 32) & 0xffffff);
+                return 1;
             }
-            
-            if (promoted_piece) {
-                // white to move
-                if (side_to_move == white)
-                {
-                    // erase the pawn from the target square
-                    pop_bit(piece_bitboards[P], target_square);
-                    
-                    // remove pawn from hash key
-                    hash_key ^= piece_keys[P][target_square];
-                }
-                
-                // black to move
-                else {
-                    pop_bit(piece_bitboards[p], target_square);
-                    
-                    hash_key ^= piece_keys[p][target_square];
-                }
-                
-                set_bit(piece_bitboards[promoted_piece], target_square);
-                
-                hash_key ^= piece_keys[promoted_piece][target_square];
+        }
+        return 0;
+    }
+
+    void store(U64 hash_key, int depth, int flag, int score, int eval, int move) {
+        Slot *slots = buckets[hash_key & mask].slots;
+        uint16_t key = slot_key(hash_key);
+
+        Slot *replace = &slots[0];
+        U64 replace_info = 0, replace_data = 0;
+        int replace_worth = MAX_VAL;
+        for (int i = 0; i < BUCKET_ENTRIES; i++) {
+            U64 info = slots[i].info.load(std::memory_order_relaxed);
+            U64 data = slots[i].data.load(std::memory_order_relaxed);
+            if (!info_generation_flag(info) || info_key(info, data) == key) {
+                replace = &slots[i];
+                replace_info = info;
+                replace_data = data;
+                break;
             }
-            
-            if (en_passant) {
-                (side_to_move == white) ? pop_bit(piece_bitboards[p], target_square + 8) :
-                                pop_bit(piece_bitboards[P], target_square - 8);
-                                
-                if (side_to_move == white) {
-                    pop_bit(piece_bitboards[p], target_square + 8);
-                    hash_key ^= piece_keys[p][target_square + 8];
-                }
-                
-                else {
-                    pop_bit(piece_bitboards[P], target_square - 8);
-                    hash_key ^= piece_keys[P][target_square - 8];
-                }
+            int worth = (int)(data >> 56) - 8 * age(info);
+            if (worth < replace_worth) {
+                replace = &slots[i];
+                replace_info = info;
+                replace_data = data;
+                replace_worth = worth;
             }
-            
-            if (en_passant_square != -1) hash_key ^= enpassant_keys[en_passant];
-            
-            en_passant_square = -1;
-            
-            if (double_push) {
-                if (side_to_move == white) {
-                    en_passant_square = target_square + 8;
-                    hash_key ^= enpassant_keys[target_square + 8];
-                }
-                
-                else {
-                    en_passant_square = target_square - 8;
-                    hash_key ^= enpassant_keys[target_square - 8];
-                }
+        }
+
+        if (info_generation_flag(replace_info) && info_key(replace_info, replace_data) == key) {
+            if (!move)
+                move = (int)((replace_data >> 32) & 0xffffff);
+            if (eval == NO_EVAL)
+                eval = (int16_t)(replace_info >> 16);
+            // A bound from a much shallower search of this one is worth less
+            // than what is there, but its move is still the latest best guess
+            if (flag != hash_flag_exact && depth + 2 < (int)(replace_data >> 56) && !age(replace_info)) {
+                depth = (int)(replace_data >> 56);
+                flag = (info_generation_flag(replace_info) & 3) - 1;
+                score = (int32_t)replace_data;
+            }
+        }
+
+        U64 data = (uint32_t)score | (U64)(move & 0xffffff) << 32 | (U64)depth << 56;
+        U64 info = (uint16_t)(key ^ fold(data)) | (U64)(uint16_t)eval << 16 |
+                   (U64)(generation << 2 | (flag + 1)) << 32;
+        replace->info.store(info, std::memory_order_relaxed);
+        replace->data.store(data, std::memory_order_relaxed);
+    }
+
+private:
+    enum { BUCKET_ENTRIES = 4 };
+
+    // info: key ^ fold(data), eval, generation << 2 | (hash flag + 1) (0 when empty)
+    // data: score, move, depth
+    struct Slot {
+        std::atomic<U64> info;
+        std::atomic<U64> data;
+    };
+
+    struct alignas(64) Bucket {
+        Slot slots[BUCKET_ENTRIES];
+    };
+
+    std::unique_ptr<Bucket[]> buckets;
+    size_t mask;
+    int generation;
+
+    static uint16_t slot_key(U64 hash_key) {
+        return hash_key >> 48;
+    }
+
+    static uint16_t fold(U64 data) {
+        return (uint16_t)(data ^ (data >> 16) ^ (data >> 32) ^ (data >> 48));
+    }
+
+    static uint16_t info_key(U64 info, U64 data) {
+        return (uint16_t)info ^ fold(data);
+    }
+
+    static int info_generation_flag(U64 info) {
+        return (int)(info >> 32) & 0xff;
+    }
+
+    int age(U64 info) const {
+        return (generation - (info_generation_flag(info) >> 2)) & 63;
+    }
+};
+
+// When to stop searching: whichever limit comes first, 0 meaning none. The
+// first iteration always completes, so that there is a move to play.
+struct SearchLimits {
+    int depth = 0;          // plies
+    long nodes = 0;         // nodes searched by the main thread
+    double movetime = 0;    // seconds from the start of the search
+    double deadline = 0;    // seconds since the epoch of std::chrono::steady_clock
+    const std::atomic<int> *stop = NULL;  // raised by another thread to stop the search
+
+    SearchLimits(int depth = 0) : depth(depth) {}
+};
+
+// An iteration of iterative deepening completed by the main thread
+struct SearchIteration {
+    int depth;
+    int score;
+    std::vector<int> pv;
+    long nodes;      // main thread nodes since the start of the search
+    double seconds;  // since the start of the search
+};
+
+// What a search did, to see where its time went. The counters add up all
+// threads, the iterations are those of the main one.
+struct SearchStats {
+    long nodes = 0;                  // negamax and quiescence nodes
+    long qnodes = 0;                 // of those, quiescence nodes
+    long evals = 0;                  // static evaluations
+    long tt_probes = 0;
+    long tt_hits = 0;                // probes finding the position
+    long tt_cutoffs = 0;             // nodes settled by the table
+    long null_move_cutoffs = 0;
+    long lmr_researches = 0;         // reduced searches raising alpha, searched again at full depth
+    long fail_highs = 0;             // beta cutoffs by a move, quiescence aside
+    long first_move_fail_highs = 0;  // of those, by the first move searched
+    double seconds = 0;
+    std::vector<SearchIteration> iterations;
+
+    void add_counters(const SearchStats &other){
+        nodes += other.nodes;
+        qnodes += other.qnodes;
+        evals += other.evals;
+        tt_probes += other.tt_probes;
+        tt_hits += other.tt_hits;
+        tt_cutoffs += other.tt_cutoffs;
+        null_move_cutoffs += other.null_move_cutoffs;
+        lmr_researches += other.lmr_researches;
+        fail_highs += other.fail_highs;
+        first_move_fail_highs += other.first_move_fail_highs;
+    }
+};
+
+// Forward pruning and late move reductions, margins in centipawns. Each
+// pruning applies at depths up to its *_depth, 0 turning it off, and never
+// at principal variation nodes or in check.
+struct PruningConfig {
+    // Reverse futility: cut when the static eval beats beta by margin * depth
+    int reverse_futility_depth = 6;
+    int reverse_futility_margin = 90;
+    // Futility: skip quiet moves when the static eval is below alpha by
+    // more than base + margin * depth
+    int futility_depth = 5;
+    int futility_base = 80;
+    int futility_margin = 90;
+    // Razoring: drop into quiescence when the static eval is below alpha by
+    // more than base + margin * depth, and trust it if it fails low
+    int razoring_depth = 3;
+    int razoring_base = 200;
+    int razoring_margin = 150;
+    // Late move pruning: skip quiet moves after base + depth * depth moves
+    int late_move_pruning_depth = 6;
+    int late_move_pruning_base = 3;
+    // Delta pruning in quiescence: skip captures that leave the static eval
+    // below alpha by more than this, after adding the captured piece
+    int delta_margin = 200;
+    // Quiet moves after the first full_moves, at depth min_depth or more,
+    // are reduced by base + log(depth) * log(move number) / divisor plies
+    int reduction_full_moves = 4;
+    int reduction_min_depth = 3;
+    double reduction_base = 0.75;
+    double reduction_divisor = 2.25;
+};
+
+// Seconds since the epoch of std::chrono::steady_clock, the clock of
+// SearchLimits::deadline (CLOCK_MONOTONIC on Linux, as Python's
+// time.monotonic())
+static double steady_seconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Search data: transposition table, move ordering heuristics, principal
+// variation and NNUE accumulators. A Searcher can be shared by several
+// boards, as long as they don't search at the same time. Changing its
+// settings or clearing it stops the search under way, if any, and waits
+// for it to return.
+//
+// With more than one thread, the search is Lazy SMP: helper Searchers run
+// the same iterative deepening on their own copy of the position, to the
+// same depth, sharing only the transposition table, until the main one is
+// done. Their results
+// reach the main search through the table alone.
+class Searcher {
+public:
+    int pv_table[MAX_PLY][MAX_PLY];
+    long nodes;
+
+    Searcher(size_t hash_mb = DEFAULT_HASH_MB, int threads = 1)
+        : Searcher(std::make_shared<TranspositionTable>(hash_mb), &stop_flag) {
+        set_threads(threads);
+    }
+
+    void set_pruning_config(const PruningConfig &config){
+        std::unique_lock<std::mutex> lock = interrupt_search();
+        pruning = config;
+        for (int depth = 0; depth < MAX_PLY; depth++)
+            for (int move = 0; move < 64; move++)
+                reductions[depth][move] = (depth && move)
+                    ? (int)(config.reduction_base + log(depth) * log(move) / config.reduction_divisor)
+                    : 0;
+        for (size_t i = 0; i < helpers.size(); i++)
+            helpers[i]->set_pruning_config(config);
+    }
+
+    const PruningConfig &pruning_config() const {
+        return pruning;
+    }
+
+    // Evaluate with the given network, NULL for the default one loaded by
+    // nnue_init. The network is not owned.
+    void set_nnue_network(const NnueNetwork *network){
+        nnue_network = network;
+    }
+
+    int best_move() {
+        return pv_table[0][0];
+    }
+
+    // Search root, reached through the positions whose keys are game_keys,
+    // within limits. When stopped by a limit, the best move and principal
+    // variation are those of the last completed iteration.
+    void search_position(const ChessPosition &root, const U64 *game_keys, int game_length, const SearchLimits &limits){
+        std::lock_guard<std::mutex> lock(search_mutex);
+        tt->new_search();
+        stop_flag.store(0, std::memory_order_relaxed);
+        start_time = steady_seconds();
+
+        int depth = (limits.depth > 0 && limits.depth < MAX_PLY) ? limits.depth : MAX_PLY - 1;
+        node_limit = limits.nodes;
+        stop_request = limits.stop;
+        stop_time = 0;
+        if (limits.movetime > 0)
+            stop_time = steady_seconds() + limits.movetime;
+        if (limits.deadline > 0 && (stop_time == 0 || limits.deadline < stop_time))
+            stop_time = limits.deadline;
+
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < helpers.size(); i++) {
+            helpers[i]->set_nnue_network(nnue_network);
+            workers.emplace_back([&, i, depth]() {
+                helpers[i]->iterative_deepening(root, game_keys, game_length, depth, (int)i + 1);
+            });
+        }
+
+        iterative_deepening(root, game_keys, game_length, depth, 0);
+
+        stop_flag.store(1, std::memory_order_relaxed);
+        for (size_t i = 0; i < workers.size(); i++) {
+            workers[i].join();
+            nodes += helpers[i]->nodes;
+            stats.add_counters(helpers[i]->stats);
+        }
+        stats.seconds = steady_seconds() - start_time;
+    }
+
+    // Statistics of the last search
+    const SearchStats &search_stats() const {
+        return stats;
+    }
+
+    void clear_hash_table(){
+        std::unique_lock<std::mutex> lock = interrupt_search();
+        tt->clear();
+    }
+
+    // Forget what earlier searches learnt, for a search of another game:
+    // the transposition table, move ordering and the principal variation
+    // followed from one move to the next
+    void new_game(){
+        std::unique_lock<std::mutex> lock = interrupt_search();
+        tt->clear();
+        clear_heuristics();
+    }
+
+    // Resize the transposition table to size_mb MB, clearing it
+    void set_hash_size(size_t size_mb){
+        std::unique_lock<std::mutex> lock = interrupt_search();
+        tt->resize(size_mb);
+    }
+
+    size_t hash_size() const {
+        return tt->size_mb();
+    }
+
+    void search_position(const ChessPosition &root, const U64 *game_keys, int game_length, int depth){
+        search_position(root, game_keys, game_length, SearchLimits(depth));
+    }
+
+    // Number of threads searching, the main one included
+    void set_threads(int threads){
+        std::unique_lock<std::mutex> lock = interrupt_search();
+        if (threads < 1)
+            threads = 1;
+        helpers.resize(threads - 1);
+        for (size_t i = 0; i < helpers.size(); i++)
+            if (!helpers[i]) {
+                helpers[i].reset(new Searcher(tt, &stop_flag));
+                helpers[i]->set_pruning_config(pruning);
+            }
+    }
+
+    int threads() const {
+        return (int)helpers.size() + 1;
+    }
+
+private:
+    ChessPosition pos;
+
+    int killer_moves[2][MAX_PLY];
+    // Quiet move ordering, kept from one search to the next until new_game:
+    // history by side, source and target square, the reply to each piece
+    // and target square last to cause a cutoff, and history by the piece and
+    // target of the move one or two plies before
+    int history_moves[2][64][64];
+    int counter_moves[12][64];
+    int16_t continuation_history[12][64][12][64];
+    int previous_moves[MAX_PLY + 1];  // move leading to the position at each ply, 0 for a null move
+    int pv_length[MAX_PLY];
+    
+    int follow_pv;
+    int ply;
+
+    std::vector<U64> repetition_table;
+    int repetition_index;
+
+    const NnueNetwork *nnue_network;
+    NNUEdata nnue_stack[MAX_NNUE_PLY];
+    int nnue_ply;
+
+    PruningConfig pruning;
+    int reductions[MAX_PLY][64];
+
+    std::shared_ptr<TranspositionTable> tt;
+    std::vector<std::unique_ptr<Searcher>> helpers;
+    std::atomic<int> stop_flag;
+    const std::atomic<int> *stop;  // the main Searcher's stop_flag
+
+    // Held by search_position; interrupts counts the threads waiting for it
+    // to change the Searcher, which stop the search
+    std::mutex search_mutex;
+    std::atomic<int> interrupts;
+
+    // Limits of the main Searcher, none for helpers, checked once an
+    // iteration is complete
+    long node_limit;
+    const std::atomic<int> *stop_request;
+    double stop_time;
+    double start_time;
+    int completed_depth;
+    int completed_pv[MAX_PLY];
+    int completed_length;
+
+    // Principal variation of the last search, with the key of the position
+    // after each move, to pick it up again if the game went down it
+    int last_pv[MAX_PLY];
+    U64 last_pv_keys[MAX_PLY];
+    int last_pv_length;
+
+    SearchStats stats;
+
+    Searcher(std::shared_ptr<TranspositionTable> table, const std::atomic<int> *main_stop)
+        : tt(table), stop(main_stop) {
+        nnue_network = NULL;
+        nodes = 0;
+        node_limit = 0;
+        stop_request = NULL;
+        stop_time = 0;
+        start_time = 0;
+        completed_depth = 0;
+        stop_flag.store(0, std::memory_order_relaxed);
+        interrupts.store(0, std::memory_order_relaxed);
+        clear_heuristics();
+        set_pruning_config(PruningConfig());
+    }
+
+    void clear_heuristics(){
+        memset(pv_table, 0, sizeof(pv_table));
+        memset(killer_moves, 0, sizeof(killer_moves));
+        memset(history_moves, 0, sizeof(history_moves));
+        memset(counter_moves, 0, sizeof(counter_moves));
+        memset(continuation_history, 0, sizeof(continuation_history));
+        last_pv_length = 0;
+        for (size_t i = 0; i < helpers.size(); i++)
+            helpers[i]->clear_heuristics();
+    }
+
+    // Plies from the root of the last search to root along its principal
+    // variation, 0 if root is not on it
+    int plies_into_last_pv(const ChessPosition &root){
+        for (int i = 0; i < last_pv_length; i++)
+            if (last_pv_keys[i] == root.hash_key)
+                return i + 1;
+        return 0;
+    }
+
+    void save_last_pv(const ChessPosition &root){
+        ChessPosition line = root;
+        last_pv_length = 0;
+        for (int i = 0; i < pv_length[0]; i++){
+            UndoInfo undo;
+            if (!line.is_legal_move(pv_table[0][i]) || !line.apply_move(pv_table[0][i], 0, &undo))
+                break;
+            last_pv[i] = pv_table[0][i];
+            last_pv_keys[i] = line.hash_key;
+            last_pv_length = i + 1;
+        }
+    }
+
+    int stopped() const {
+        return stop->load(std::memory_order_relaxed);
+    }
+
+    // Stop the search under way and keep the next one from starting while
+    // the lock returned is held
+    std::unique_lock<std::mutex> interrupt_search(){
+        interrupts.fetch_add(1);
+        std::unique_lock<std::mutex> lock(search_mutex);
+        interrupts.fetch_sub(1);
+        return lock;
+    }
+
+    // Count a node, stopping the search when past a limit. The clock is
+    // only read every 1024 nodes.
+    void count_node(){
+        nodes++;
+        if (!completed_depth)
+            return;
+        if ((node_limit && nodes >= node_limit) ||
+            (stop_request && stop_request->load(std::memory_order_relaxed)) ||
+            interrupts.load(std::memory_order_relaxed) ||
+            (stop_time && (nodes & 1023) == 0 && steady_seconds() >= stop_time))
+            stop_flag.store(1, std::memory_order_relaxed);
+    }
+
+    // Deepen one ply at a time up to depth or until stopped. Helpers with an
+    // odd thread_id skip depth 1, so that threads are not all on the same
+    // iteration.
+    void iterative_deepening(const ChessPosition &root, const U64 *game_keys, int game_length, int depth, int thread_id){
+        pos = root;
+        repetition_table.assign(game_keys, game_keys + game_length);
+        repetition_table.resize(game_length + MAX_NNUE_PLY);
+        repetition_index = game_length;
+        reset_nnue_stack();
+
+        int score = 0;
+        nodes = 0;
+        stats = SearchStats();
+        completed_depth = 0;
+        completed_length = 0;
+        ply = 0;
+        follow_pv = 0;
+        memset(pv_table, 0, sizeof(pv_table));
+        memset(pv_length, 0, sizeof(pv_length));
+        previous_moves[0] = 0;
+
+        // When the game went down the last principal variation, the first
+        // iteration follows the rest of it and the killers move up by as
+        // many plies; the table keeps the rest of the tree
+        int shift = plies_into_last_pv(root);
+        if (shift) {
+            pv_length[0] = last_pv_length - shift;
+            memcpy(pv_table[0], last_pv + shift, pv_length[0] * sizeof(int));
+            for (int i = 0; i < 2; i++) {
+                memmove(killer_moves[i], killer_moves[i] + shift, (MAX_PLY - shift) * sizeof(int));
+                memset(killer_moves[i] + MAX_PLY - shift, 0, shift * sizeof(int));
             }
-            
-            if (castling){
-                switch (target_square){
-                    case (g1):
-                        // move H rook
-                        pop_bit(piece_bitboards[R], h1);
-                        set_bit(piece_bitboards[R], f1);
-                        
-                        // hash rook
-                        hash_key ^= piece_keys[R][h1];  // remove rook from h1 from hash key
-                        hash_key ^= piece_keys[R][f1];  // put rook on f1 into a hash key
-                        break;
-                    
-                    // white castles queen side
-                    case (c1):
-                        // move A rook
-                        pop_bit(piece_bitboards[R], a1);
-                        set_bit(piece_bitboards[R], d1);
-                        
-                        // hash rook
-                        hash_key ^= piece_keys[R][a1];  // remove rook from a1 from hash key
-                        hash_key ^= piece_keys[R][d1];  // put rook on d1 into a hash key
-                        break;
-                    
-                    // black castles king side
-                    case (g8):
-                        // move H rook
-                        pop_bit(piece_bitboards[r], h8);
-                        set_bit(piece_bitboards[r], f8);
-                        
-                        // hash rook
-                        hash_key ^= piece_keys[r][h8];  // remove rook from h8 from hash key
-                        hash_key ^= piece_keys[r][f8];  // put rook on f8 into a hash key
-                        break;
-                    
-                    // black castles queen side
-                    case (c8):
-                        pop_bit(piece_bitboards[r], a8);
-                        set_bit(piece_bitboards[r], d8);
-                        hash_key ^= piece_keys[r][a8];  // remove rook from a8 from hash key
-                        hash_key ^= piece_keys[r][d8];  // put rook on d8 into a hash key
-                        break;
-                }
+        }
+        else
+            memset(killer_moves, 0, sizeof(killer_moves));
+
+        int alpha = -MAX_VAL;
+        int beta = MAX_VAL;
+
+        // Compute the root accumulator once; every node below updates from it
+        evaluate();
+        
+        for (int current_depth = 1 + (thread_id & 1); current_depth <= depth && !stopped(); current_depth++){
+            follow_pv = 1;
+            score = negamax(current_depth, alpha, beta);
+            if ((score <= alpha) || (score >= beta)){
+                alpha = -MAX_VAL;
+                beta = MAX_VAL;
+                continue;
             }
-            
-            hash_key ^= castle_keys[castling_rights];
-            castling_rights &= castling_rights_sq[source_square];
-            castling_rights &= castling_rights_sq[target_square];
-            hash_key ^= castle_keys[castling_rights];
-            
-            memset(block_bitboards, 0ULL, 24);
-            
-            for (int bb_piece = P; bb_piece <= K; bb_piece++)
-                block_bitboards[white] |= piece_bitboards[bb_piece];
-
-            for (int bb_piece = p; bb_piece <= k; bb_piece++)
-                block_bitboards[black] |= piece_bitboards[bb_piece];
-
-            
-            block_bitboards[2] |= block_bitboards[white];
-            block_bitboards[2] |= block_bitboards[black];
-            
-            side_to_move ^= 1;
-            
-            hash_key ^= side_key;
-
-            if (is_square_attacked((side_to_move == white) ? get_lsb_index(piece_bitboards[k]) : get_lsb_index(piece_bitboards[K]), side_to_move)) {
-                revert_move(*undo);
-                return 0;
+            if (stopped())
+                break;
+            alpha = score - 50;
+            beta = score + 50;
+
+            completed_depth = current_depth;
+            completed_length = pv_length[0];
+            memcpy(completed_pv, pv_table[0], sizeof(completed_pv));
+
+            if (thread_id == 0) {
+                SearchIteration iteration;
+                iteration.depth = current_depth;
+                iteration.score = score;
+                iteration.pv.assign(pv_table[0], pv_table[0] + pv_length[0]);
+                iteration.nodes = nodes;
+                iteration.seconds = steady_seconds() - start_time;
+                stats.iterations.push_back(iteration);
             }
-            else
-                return 1;
         }
-
-        else {
-            if (decode_move_capture(move))
-                return apply_move(move, 0, undo);
-            else
-                return 0;
+        if (completed_depth){
+            memcpy(pv_table[0], completed_pv, sizeof(completed_pv));
+            pv_length[0] = completed_length;
         }
+        save_last_pv(root);
+        stats.nodes = nodes;
+        // printf("\n");
+        // printf("bestmove ");
+        // print_move(pv_table[0][0]);
+        // printf("\n");
     }
 
-    U64 get_bishop_attacks(int square, U64 block){
-        block &= bishop_masks[square];
-        block *= bishop_magic[square];
-        block >>= (64 - bishop_rel_bits[square]);
-        return bishop_attacks[square][block];
-    }
 
-    U64 get_rook_attacks(int square, U64 block){
-        block &= rook_masks[square];
-        block *= rook_magic[square];
-        block >>= (64 - rook_rel_bits[square]);
-        return rook_attacks[square][block];
-    }
+    enum pick_stages { pick_hash_move, pick_init_captures, pick_captures, pick_killers, pick_counter_move,
+                       pick_init_quiets, pick_quiets, pick_bad_captures, pick_done };
 
-    U64 get_queen_attacks(int square, U64 block){
-        U64 result = 0ULL;
-        U64 bishop_block = block;
-        U64 rook_block = block;
-        bishop_block &= bishop_masks[square];
-        rook_block &= rook_masks[square];
-        bishop_block *= bishop_magic[square];
-        bishop_block >>= (64 - bishop_rel_bits[square]);
-        rook_block *= rook_magic[square];
-        rook_block >>= (64 - rook_rel_bits[square]);
-        result |= bishop_attacks[square][bishop_block];
-        result |= rook_attacks[square][rook_block];
-        return result;
+    typedef struct {
+        int stage;
+        int move_type;
+        int hash_move;
+        int killers[2];
+        int counter_move;
+        int index;
+        move_list moves;
+        int scores[256];
+        move_list bad_captures;
+    } MovePicker;
+
+
+    void reset_nnue_stack() {
+        nnue_ply = 0;
+        nnue_stack[0].accumulator.computedAccumulation = false;
     }
 
-    int is_square_attacked(int square, int side){
-        if ((side  == white) && (pawn_attacks[black][square] & piece_bitboards[P])){return 1;}
-        if ((side  == black) && (pawn_attacks[white][square] & piece_bitboards[p])){return 1;}
-        if ((side  == white) && (knight_attacks[square] & piece_bitboards[N])){return 1;}
-        if ((side  == black) && (knight_attacks[square] & piece_bitboards[n])){return 1;}
-        if ((side  == white) && (king_attacks[square] & piece_bitboards[K])){return 1;}
-        if ((side  == black) && (king_attacks[square] & piece_bitboards[k])){return 1;}
-        if ((side  == white) && (get_bishop_attacks(square, block_bitboards[2]) & piece_bitboards[B])){return 1;}
-        if ((side  == black) && (get_bishop_attacks(square, block_bitboards[2]) & piece_bitboards[b])){return 1;}
-        if ((side  == white) && (get_rook_attacks(square, block_bitboards[2]) & piece_bitboards[R])){return 1;}
-        if ((side  == black) && (get_rook_attacks(square, block_bitboards[2]) & piece_bitboards[r])){return 1;}
-        if ((side  == white) && (get_queen_attacks(square, block_bitboards[2]) & piece_bitboards[Q])){return 1;}
-        if ((side  == black) && (get_queen_attacks(square, block_bitboards[2]) & piece_bitboards[q])){return 1;}
-        return 0;
+    DirtyPiece *push_nnue_stack() {
+        assert(nnue_ply + 1 < MAX_NNUE_PLY);
+        NNUEdata *nnue = &nnue_stack[++nnue_ply];
+        nnue->accumulator.computedAccumulation = false;
+        nnue->dirtyPiece.dirtyNum = 0;
+        nnue->dirtyPiece.pc[0] = 0;
+        return &nnue->dirtyPiece;
     }
 
-    int evaluate_nnue(int player, int *pieces, int *squares) {
-        return nnue_evaluate(player, pieces, squares);
+    int make(int move, int only_capture_flag, UndoInfo *undo) {
+        previous_moves[ply] = move;
+        if (pos.apply_move(move, only_capture_flag, undo, push_nnue_stack()))
+            return 1;
+        nnue_ply--;
+        return 0;
     }
 
-    int evaluate_fen_nnue(char *fen) {
-        return nnue_evaluate_fen(fen);
+    void unmake(const UndoInfo &undo) {
+        pos.revert_move(undo);
+        nnue_ply--;
     }
 
     int evaluate() {
-        U64 bitboard;
-        int piece, square;
+        PROFILE_SCOPE(profile_evaluate);
+        stats.evals++;
         int pieces[33];
         int squares[33];
-        int index = 2;
+        pos.nnue_input(pieces, squares);
+        int score = nnue_network
+            ? nnue_network_evaluate_incremental(nnue_network, pos.side_to_move, pieces, squares, nnue_stack, nnue_ply)
+            : nnue_evaluate_incremental(pos.side_to_move, pieces, squares, nnue_stack, nnue_ply);
+        return (score * (100 - pos.fifty) / 100);
+    }
 
-        for (int bb_piece = P; bb_piece <= k; bb_piece++) {
-            bitboard = piece_bitboards[bb_piece];
-            while (bitboard) {
-                piece = bb_piece;
-                
-                square = get_lsb_index(bitboard);
-                
-                if (piece == K) {
-                    pieces[0] = nnue_pieces[piece];
-                    squares[0] = nnue_squares[square];
+    // Moves are handed out in stages, best guesses first: the hash move,
+    // captures that don't lose material by MVV-LVA, killers, the counter
+    // move, quiet moves by history, then captures losing material by static
+    // exchange. Each stage
+    // only runs when the ones before didn't cause a cutoff, and each list is
+    // searched by picking the best remaining move rather than sorting. With
+    // move_type captures, as in quiescence, losing captures are left out,
+    // and the hash move is only tried when it is a capture.
+    void init_move_picker(MovePicker *picker, int hash_move, int move_type){
+        picker->stage = pick_hash_move;
+        picker->move_type = move_type;
+        picker->hash_move = (hash_move && (move_type != captures || decode_move_capture(hash_move)) &&
+                             pos.is_legal_move(hash_move)) ? hash_move : 0;
+        picker->killers[0] = killer_moves[0][ply];
+        picker->killers[1] = killer_moves[1][ply];
+        int previous_move = previous_moves[ply];
+        picker->counter_move = previous_move
+            ? counter_moves[decode_move_piece(previous_move)][decode_move_target(previous_move)] : 0;
+        if (picker->counter_move == picker->killers[0] || picker->counter_move == picker->killers[1])
+            picker->counter_move = 0;
+    }
+
+    int next_move(MovePicker *picker){
+        PROFILE_SCOPE(profile_move_ordering);
+        switch (picker->stage){
+            case pick_hash_move:
+                picker->stage = pick_init_captures;
+                if (picker->hash_move)
+                    return picker->hash_move;
+                // fall through
+            case pick_init_captures:
+                pos.generate_moves(&picker->moves, captures);
+                for (int i = 0; i < picker->moves.move_count; i++)
+                    picker->scores[i] = score_capture(picker->moves.moves[i]);
+                picker->index = 0;
+                picker->bad_captures.move_count = 0;
+                picker->stage = pick_captures;
+                // fall through
+            case pick_captures:
+                while (picker->index < picker->moves.move_count){
+                    int move = select_best(picker);
+                    if (move == picker->hash_move)
+                        continue;
+                    if (is_losing_capture(move)) {
+                        picker->bad_captures.moves[picker->bad_captures.move_count++] = move;
+                        continue;
+                    }
+                    return move;
                 }
-                
-                else if (piece == k) {
-                    pieces[1] = nnue_pieces[piece];
-                    squares[1] = nnue_squares[square];
+                if (picker->move_type == captures)
+                    break;
+                picker->stage = pick_killers;
+                picker->index = 0;
+                // fall through
+            case pick_killers:
+                while (picker->index < 2){
+                    int move = picker->killers[picker->index++];
+                    if (move && move != picker->hash_move && !decode_move_capture(move) && pos.is_legal_move(move))
+                        return move;
                 }
-                
-                else {
-                    pieces[index] = nnue_pieces[piece];
-                    squares[index] = nnue_squares[square];
-                    index++;    
+                picker->stage = pick_counter_move;
+                // fall through
+            case pick_counter_move:
+                picker->stage = pick_init_quiets;
+                if (picker->counter_move && picker->counter_move != picker->hash_move &&
+                    !decode_move_capture(picker->counter_move) && pos.is_legal_move(picker->counter_move))
+                    return picker->counter_move;
+                // fall through
+            case pick_init_quiets:
+                pos.generate_moves(&picker->moves, quiet_moves);
+                for (int i = 0; i < picker->moves.move_count; i++)
+                    picker->scores[i] = quiet_history(picker->moves.moves[i]);
+                picker->index = 0;
+                picker->stage = pick_quiets;
+                // fall through
+            case pick_quiets:
+                while (picker->index < picker->moves.move_count){
+                    int move = select_best(picker);
+                    if (move != picker->hash_move && move != picker->killers[0] && move != picker->killers[1] &&
+                        move != picker->counter_move)
+                        return move;
                 }
-
-                pop_bit(bitboard, square);
-            }
+                picker->stage = pick_bad_captures;
+                picker->index = 0;
+                // fall through
+            case pick_bad_captures:
+                if (picker->index < picker->bad_captures.move_count)
+                    return picker->bad_captures.moves[picker->index++];
+                break;
         }
-        
-        pieces[index] = 0;
-        squares[index] = 0;
-        return (evaluate_nnue(side_to_move, pieces, squares) * (100 - fifty) / 100);
+        picker->stage = pick_done;
+        return 0;
     }
 
-    void enable_pv_scoring(move_list *move_list){
-        follow_pv = 0;
-        for (int i = 0; i < move_list->move_count; i++){
-            int move = move_list->moves[i];
-            if (pv_table[0][ply] == move){
-                score_pv = 1;
-                follow_pv = 1;
-                break;
-            }
-        }
+    // Swap the best of the moves not handed out yet to the front and return it
+    int select_best(MovePicker *picker){
+        int best = picker->index;
+        for (int i = picker->index + 1; i < picker->moves.move_count; i++)
+            if (picker->scores[i] > picker->scores[best])
+                best = i;
+
+        int move = picker->moves.moves[best];
+        picker->moves.moves[best] = picker->moves.moves[picker->index];
+        picker->scores[best] = picker->scores[picker->index];
+        picker->index++;
+        return move;
     }
 
-    int score_move(int move){
-        if (score_pv){
-            if (pv_table[0][ply] == move){
-                score_pv = 0;
-                return 20000;
-            }
-        }
-        if (decode_move_capture(move)){
-            int target_piece = P;
-            int start_piece, end_piece;
-            
-            if (side_to_move == white) { start_piece = p; end_piece = k; }
-            else { start_piece = P; end_piece = K; }
-            
-            for (int bb_piece = start_piece; bb_piece <= end_piece; bb_piece++){
-                if (get_bit(piece_bitboards[bb_piece], decode_move_target(move))){
-                    target_piece = bb_piece;
-                    break;
-                }
-            }
-            return mvv_lva[decode_move_piece(move)][target_piece] + 10000;
-        }
-        
-        else {
-            if (move == killer_moves[0][ply])
-                return 9000;
-            else if (move == killer_moves[1][ply])
-                return 8000;
-            else 
-                return history_moves[decode_move_piece(move)][decode_move_target(move)];
-        }
+    // Continuation history tables for the moves one and two plies before
+    // the position at this ply, NULL after a null move or at the root
+    int16_t *continuation_table(int plies_back){
+        int move = (ply >= plies_back - 1) ? previous_moves[ply - plies_back + 1] : 0;
+        return move ? &continuation_history[decode_move_piece(move)][decode_move_target(move)][0][0] : NULL;
     }
 
-    void sort_moves(move_list *move_list){
-        int move_scores[move_list->move_count];
-        
-        for (int count = 0; count < move_list->move_count; count++)
-            move_scores[count] = score_move(move_list->moves[count]);
-        
-        for (int current_move = 0; current_move < move_list->move_count; current_move++){
-            for (int next_move = current_move + 1; next_move < move_list->move_count; next_move++){
-                if (move_scores[current_move] < move_scores[next_move]){
-                    int temp_score = move_scores[current_move];
-                    move_scores[current_move] = move_scores[next_move];
-                    move_scores[next_move] = temp_score;
-                    
-                    int temp_move = move_list->moves[current_move];
-                    move_list->moves[current_move] = move_list->moves[next_move];
-                    move_list->moves[next_move] = temp_move;
-                }
-            }
-        }
+    int quiet_history(int move){
+        int piece = decode_move_piece(move);
+        int target_square = decode_move_target(move);
+        int score = history_moves[pos.side_to_move][decode_move_source(move)][target_square];
+        int16_t *continuation;
+        if ((continuation = continuation_table(1)))
+            score += continuation[piece * 64 + target_square];
+        if ((continuation = continuation_table(2)))
+            score += continuation[piece * 64 + target_square];
+        return score;
     }
 
-    void clear_hash_table(){
-        for (int index = 0; index < hash_size; index++){
-            hash_table[index].hash_key = 0;
-            hash_table[index].depth = 0;
-            hash_table[index].flag = 0;
-            hash_table[index].score = 0;
+    // Move entry towards +-MAX_HISTORY by bonus, the closer it already is
+    // the less, so that entries stay bounded and recent results weigh most
+    static void update_history(int *entry, int bonus){
+        *entry += bonus - *entry * abs(bonus) / MAX_HISTORY;
+    }
+
+    static void update_history(int16_t *entry, int bonus){
+        int value = *entry;
+        update_history(&value, bonus);
+        *entry = value;
+    }
+
+    void update_quiet_history(int move, int bonus){
+        int piece = decode_move_piece(move);
+        int target_square = decode_move_target(move);
+        update_history(&history_moves[pos.side_to_move][decode_move_source(move)][target_square], bonus);
+        int16_t *continuation;
+        if ((continuation = continuation_table(1)))
+            update_history(&continuation[piece * 64 + target_square], bonus);
+        if ((continuation = continuation_table(2)))
+            update_history(&continuation[piece * 64 + target_square], bonus);
+    }
+
+    // Reward the quiet move causing a cutoff and penalise those searched
+    // before it
+    void update_quiet_stats(int move, const int *quiets_searched, int quiet_count, int depth){
+        int bonus = (depth < 11) ? 150 * depth - 100 : 1600;
+
+        update_quiet_history(move, bonus);
+        for (int i = 0; i < quiet_count; i++)
+            if (quiets_searched[i] != move)
+                update_quiet_history(quiets_searched[i], -bonus);
+
+        if (killer_moves[0][ply] != move) {
+            killer_moves[1][ply] = killer_moves[0][ply];
+            killer_moves[0][ply] = move;
         }
+        int previous_move = previous_moves[ply];
+        if (previous_move)
+            counter_moves[decode_move_piece(previous_move)][decode_move_target(previous_move)] = move;
     }
 
-    int read_tt_entry(int alpha, int beta, int depth){
-        TT *hash_entry = &hash_table[hash_key % hash_size];
-        
-        if (hash_entry->hash_key == hash_key){
-            if (hash_entry->depth >= depth){
-                int score = hash_entry->score;
-                if (score < -MATE_SCORE) score += ply;
-                if (score > MATE_SCORE) score -= ply;
-            
-                if (hash_entry->flag == hash_flag_exact)
-                    return score;
-                
-                if ((hash_entry->flag == hash_flag_alpha) &&
-                    (score <= alpha))
-                    return alpha;
-                
-                if ((hash_entry->flag == hash_flag_beta) &&
-                    (score >= beta))
-                    return beta;
-            }
+    // Whether move loses material by static exchange, without working it
+    // out when the captured piece is worth at least the capturer
+    int is_losing_capture(int move){
+        int target_piece = pos.board[decode_move_target(move)];
+        if (target_piece != -1 && see_values[target_piece] >= see_values[decode_move_piece(move)])
+            return 0;
+        return pos.see(move) < 0;
+    }
+
+    int score_capture(int move){
+        int target_piece = pos.board[decode_move_target(move)];
+        if (target_piece == -1)
+            target_piece = P;  // en passant
+        return mvv_lva[decode_move_piece(move)][target_piece];
+    }
+
+    // Score of the position if the table settles it at this depth, else
+    // no_hash_entry; the stored move and static evaluation are passed back
+    // either way
+    int read_tt_entry(int alpha, int beta, int depth, int *hash_move, int *static_eval){
+        TranspositionTable::Entry entry;
+        stats.tt_probes++;
+        if (!tt->probe(pos.hash_key, &entry))
+            return no_hash_entry;
+        stats.tt_hits++;
+
+        *hash_move = entry.move;
+        *static_eval = entry.eval;
+        if (entry.depth >= depth){
+            int score = entry.score;
+            if (score < -MATE_SCORE) score += ply;
+            if (score > MATE_SCORE) score -= ply;
+
+            if (entry.flag == hash_flag_exact)
+                return score;
+
+            if ((entry.flag == hash_flag_alpha) &&
+                (score <= alpha))
+                return alpha;
+
+            if ((entry.flag == hash_flag_beta) &&
+                (score >= beta))
+                return beta;
         }
         return no_hash_entry;
     }
 
-    void write_tt_entry(int score, int depth, int hash_flag){
-        TT *hash_entry = &hash_table[hash_key % hash_size];
-
+    void write_tt_entry(int score, int depth, int hash_flag, int best_move, int static_eval){
         if (score < -MATE_SCORE) score -= ply;
         if (score > MATE_SCORE) score += ply;
-        hash_entry->hash_key = hash_key;
-        hash_entry->score = score;
-        hash_entry->flag = hash_flag;
-        hash_entry->depth = depth;
+        if (static_eval != NO_EVAL)
+            static_eval = (static_eval > 32767) ? 32767 : (static_eval < -32767) ? -32767 : static_eval;
+        tt->store(pos.hash_key, depth, hash_flag, score, static_eval, best_move);
+    }
+
+    // Whether the side to move is in check
+    int in_check(){
+        int king_square = get_lsb_index(pos.piece_bitboards[pos.side_to_move == white ? K : k]);
+        return pos.is_square_attacked(king_square, pos.side_to_move ^ 1);
     }
 
     int is_repetition(){
         for (int index = 0; index < repetition_index; index++)
-            if (repetition_table[index] == hash_key)
+            if (repetition_table[index] == pos.hash_key)
                 return 1;
         return 0;
     }
 
+    // Captures only, unless in check where every evasion is searched. The
+    // static eval stands in for the position when not in check, and
+    // captures that couldn't bring it up to alpha even with delta_margin
+    // to spare are skipped. Results go to the transposition table without
+    // a move: the best capture is a poor guess for a full-width search of
+    // the same position, and would replace the move it stored.
     int quiescence(int alpha, int beta) {
-        nodes++;
+        count_node();
+        stats.qnodes++;
 
-        if (ply > MAX_VAL - 1)
+        if (ply > MAX_PLY - 1)
             return evaluate();
 
-        int evaluation = evaluate();
-        if (evaluation >= beta)
-            return beta;
+        int hash_move = 0;
+        int static_eval = NO_EVAL;
+        int score = read_tt_entry(alpha, beta, 0, &hash_move, &static_eval);
+        if (score != no_hash_entry) {
+            stats.tt_cutoffs++;
+            return score;
+        }
 
-        if (evaluation > alpha)
-            alpha = evaluation;
+        int hash_flag = hash_flag_alpha;
+        int is_in_check = in_check();
+        if (!is_in_check) {
+            if (static_eval == NO_EVAL)
+                static_eval = evaluate();
 
-        move_list move_list[1];
-        generate_moves(move_list);
-        sort_moves(move_list);
+            if (static_eval >= beta) {
+                write_tt_entry(beta, 0, hash_flag_beta, 0, static_eval);
+                return beta;
+            }
+
+            // Not even winning a queen would do, unless a pawn is about to
+            // promote
+            U64 promoting = pos.piece_bitboards[pos.side_to_move == white ? P : p] &
+                            (pos.side_to_move == white ? 0xff00ULL : 0xff000000000000ULL);
+            if (!promoting && static_eval + see_values[Q] + pruning.delta_margin <= alpha)
+                return alpha;
 
-        for (int count = 0; count < move_list->move_count; count++) {
-            int move = move_list->moves[count];
-            if (!decode_move_capture(move)) continue;  // Only explore captures in quiescence
+            if (static_eval > alpha) {
+                alpha = static_eval;
+                hash_flag = hash_flag_exact;
+            }
+        }
+
+        MovePicker picker;
+        init_move_picker(&picker, hash_move, is_in_check ? all_moves : captures);
 
+        int legal_moves_found = 0;
+        int move;
+        while ((move = next_move(&picker))) {
             UndoInfo undo;
 
+            // Delta pruning
+            if (!is_in_check && !decode_move_promotion(move)) {
+                int target_piece = pos.board[decode_move_target(move)];
+                int gain = (target_piece == -1) ? see_values[P] : see_values[target_piece];
+                if (static_eval + gain + pruning.delta_margin <= alpha)
+                    continue;
+            }
+
             ply++;
-            repetition_index++;
-            repetition_table[repetition_index] = hash_key;
+            repetition_table[repetition_index++] = pos.hash_key;
 
-            if (!apply_move(move, 1, &undo)) {
+            if (!make(move, !is_in_check, &undo)) {
                 ply--;
                 repetition_index--;
                 continue;
             }
+            legal_moves_found++;
 
-            int score = -quiescence(-beta, -alpha);
+            score = -quiescence(-beta, -alpha);
 
-            revert_move(undo);
+            unmake(undo);
             ply--;
             repetition_index--;
 
+            if (stopped())
+                return 0;
+
             if (score > alpha) {
                 alpha = score;
+                hash_flag = hash_flag_exact;
 
-                if (score >= beta)
+                if (score >= beta) {
+                    write_tt_entry(beta, 0, hash_flag_beta, 0, static_eval);
                     return beta;
+                }
             }
         }
 
+        if (is_in_check && legal_moves_found == 0)
+            return -MATE_VALUE + ply;
+
+        write_tt_entry(alpha, 0, hash_flag, 0, static_eval);
         return alpha;
     }
 
@@ -1534,80 +2794,123 @@ private:
         int score;
         int hash_flag = hash_flag_alpha;
 
-        if ((ply && is_repetition()) || fifty >= 100)
-            return 0;
-
-        int pv_node = (beta - alpha > 1);
+        // A node's principal variation is copied from the next ply's, so
+        // the last ply of the tables is never searched
+        if (ply >= MAX_PLY - 1)
+            return evaluate();
 
-        if (ply && (score = read_tt_entry(alpha, beta, depth)) != no_hash_entry && !pv_node)
-            return score;
+        if ((ply && is_repetition()) || pos.fifty >= 100)
+            return 0;
 
         pv_length[ply] = ply;
 
+        // Quiescence probes the table itself
         if (depth == 0)
             return quiescence(alpha, beta);
             // return evaluate();
-        if (ply > MAX_PLY - 1)
-            return evaluate();
 
-        nodes++;
+        int pv_node = (beta - alpha > 1);
+
+        int hash_move = 0;
+        int static_eval = NO_EVAL;
+        score = read_tt_entry(alpha, beta, depth, &hash_move, &static_eval);
+        if (ply && score != no_hash_entry && !pv_node) {
+            stats.tt_cutoffs++;
+            return score;
+        }
 
-        int king_sq = (side_to_move == white) ? get_lsb_index(piece_bitboards[K]) : get_lsb_index(piece_bitboards[k]);
-        int is_in_check = is_square_attacked(king_sq, side_to_move ^ 1);
+        count_node();
+
+        int king_sq = (pos.side_to_move == white) ? get_lsb_index(pos.piece_bitboards[K]) : get_lsb_index(pos.piece_bitboards[k]);
+        int is_in_check = pos.is_square_attacked(king_sq, pos.side_to_move ^ 1);
         if (is_in_check)
             depth++;
+        else if (static_eval == NO_EVAL)
+            static_eval = evaluate();
 
         int legal_moves_found = 0;
 
+        // Static eval far enough above beta: assume a move will keep it there
+        if (!pv_node && !is_in_check && depth <= pruning.reverse_futility_depth &&
+            beta < MATE_SCORE && static_eval - pruning.reverse_futility_margin * depth >= beta)
+            return beta;
+
+        // Static eval far below alpha: only tactics can help, which
+        // quiescence would see
+        if (!pv_node && !is_in_check && depth <= pruning.razoring_depth &&
+            static_eval + pruning.razoring_base + pruning.razoring_margin * depth <= alpha) {
+            score = quiescence(alpha, alpha + 1);
+            if (score <= alpha)
+                return alpha;
+        }
+
         // Null move pruning
         if (depth >= 3 && !is_in_check && ply != 0) {
             UndoInfo undo;
 
             ply++;
-            repetition_index++;
-            repetition_table[repetition_index] = hash_key;
+            repetition_table[repetition_index++] = pos.hash_key;
 
             // Null move
-            if (en_passant_square != -1)
-                hash_key ^= enpassant_keys[en_passant_square];
-            undo.en_passant_square = en_passant_square;
-            en_passant_square = -1;
+            undo.hash_key = pos.hash_key;
+            if (pos.en_passant_square != -1)
+                pos.hash_key ^= enpassant_keys[pos.en_passant_square];
+            undo.en_passant_square = pos.en_passant_square;
+            pos.en_passant_square = -1;
 
-            side_to_move ^= 1;
-            hash_key ^= side_key;
+            pos.side_to_move ^= 1;
+            pos.hash_key ^= side_key;
+            push_nnue_stack();
+            previous_moves[ply] = 0;
 
             score = -negamax(depth - 1 - 2, -beta, -beta + 1);
 
-            side_to_move ^= 1;
-            hash_key ^= side_key;
-            en_passant_square = undo.en_passant_square;
+            nnue_ply--;
+            pos.side_to_move ^= 1;
+            pos.hash_key = undo.hash_key;
+            pos.en_passant_square = undo.en_passant_square;
 
             ply--;
             repetition_index--;
 
-            if (score >= beta)
+            if (stopped())
+                return 0;
+
+            if (score >= beta) {
+                stats.null_move_cutoffs++;
                 return beta;
+            }
         }
 
-        move_list list[1];
-        generate_moves(list);
-
-        if (follow_pv)
-            enable_pv_scoring(list);
+        // While on the principal variation of the last iteration, its move
+        // goes first
+        if (follow_pv) {
+            follow_pv = pos.is_legal_move(pv_table[0][ply]);
+            if (follow_pv)
+                hash_move = pv_table[0][ply];
+        }
 
-        sort_moves(list);
+        MovePicker picker;
+        init_move_picker(&picker, hash_move, all_moves);
 
         int moves_searched = 0;
+        int best_move = 0;
+        int move;
+        int quiets_searched[64];
+        int quiet_count = 0;
+
+        int futile = !pv_node && !is_in_check && depth <= pruning.futility_depth && alpha > -MATE_SCORE &&
+                     static_eval + pruning.futility_base + pruning.futility_margin * depth <= alpha;
+        int late_move_count = (!pv_node && !is_in_check && depth <= pruning.late_move_pruning_depth)
+                              ? pruning.late_move_pruning_base + depth * depth : 256;
 
-        for (int count = 0; count < list->move_count; count++) {
-            int move = list->moves[count];
+        while ((move = next_move(&picker))) {
             UndoInfo undo;
 
             ply++;
-            repetition_index++;
-            repetition_table[repetition_index] = hash_key;
+            repetition_table[repetition_index++] = pos.hash_key;
 
-            if (!apply_move(move, 0, &undo)) {
+            if (!make(move, 0, &undo)) {
                 ply--;
                 repetition_index--;
                 continue;
@@ -1615,19 +2918,38 @@ private:
 
             legal_moves_found++;
 
+            // Quiet moves unlikely to raise alpha are skipped once a move
+            // has been searched, unless they give check. They still count as
+            // legal, so that the node isn't taken for a stalemate.
+            if (moves_searched && (futile || moves_searched >= late_move_count) && alpha > -MATE_SCORE &&
+                !decode_move_capture(move) && !decode_move_promotion(move) && !in_check()) {
+                unmake(undo);
+                ply--;
+                repetition_index--;
+                continue;
+            }
+
             // Principal variation
             if (moves_searched == 0) {
                 score = -negamax(depth - 1, -beta, -alpha);
             } else {
                 // Late move reductions
                 if (
-                    moves_searched >= FULL_DEPTH_MOVES &&
-                    depth >= REDUCTION_LIMIT &&
+                    moves_searched >= pruning.reduction_full_moves &&
+                    depth >= pruning.reduction_min_depth &&
                     !is_in_check &&
                     !decode_move_capture(move) &&
                     !decode_move_promotion(move)
                 ) {
-                    score = -negamax(depth - 2, -alpha - 1, -alpha);
+                    int reduction = reductions[depth < MAX_PLY ? depth : MAX_PLY - 1][moves_searched < 64 ? moves_searched : 63];
+                    if (pv_node && reduction > 1)
+                        reduction--;
+                    if (reduction < 1)
+                        reduction = 1;
+                    int reduced_depth = depth - 1 - reduction;
+                    score = -negamax(reduced_depth > 1 ? reduced_depth : 1, -alpha - 1, -alpha);
+                    if (score > alpha)
+                        stats.lmr_researches++;
                 } else {
                     score = alpha + 1;
                 }
@@ -1638,19 +2960,22 @@ private:
                         score = -negamax(depth - 1, -beta, -alpha);
                 }
             }
-            revert_move(undo);
+            unmake(undo);
             ply--;
             repetition_index--;
 
+            // A stopped search leaves nothing behind, neither in the table
+            // nor in the principal variation
+            if (stopped())
+                return 0;
+
             moves_searched++;
+            if (!decode_move_capture(move) && quiet_count < 64)
+                quiets_searched[quiet_count++] = move;
 
             if (score > alpha) {
                 hash_flag = hash_flag_exact;
-
-                if (!decode_move_capture(move)) {
-                    history_moves[decode_move_piece(move)][decode_move_target(move)] += depth;
-                }
-
+                best_move = move;
                 alpha = score;
 
                 pv_table[ply][ply] = move;
@@ -1659,11 +2984,12 @@ private:
                 pv_length[ply] = pv_length[ply + 1];
 
                 if (score >= beta) {
-                    write_tt_entry(beta, depth, hash_flag_beta);
-                    if (!decode_move_capture(move)) {
-                        killer_moves[1][ply] = killer_moves[0][ply];
-                        killer_moves[0][ply] = move;
-                    }
+                    stats.fail_highs++;
+                    if (moves_searched == 1)
+                        stats.first_move_fail_highs++;
+                    write_tt_entry(beta, depth, hash_flag_beta, move, static_eval);
+                    if (!decode_move_capture(move))
+                        update_quiet_stats(move, quiets_searched, quiet_count, depth);
                     return beta;
                 }
             }
@@ -1676,7 +3002,177 @@ private:
                 return 0;
         }
 
-        write_tt_entry(alpha, depth, hash_flag);
+        write_tt_entry(alpha, depth, hash_flag, best_move, static_eval);
         return alpha;
     }
+};
+
+// Perft below each legal move of root, the moves being shared out between
+// threads that each work on their own copy of the position
+static std::vector<uint64_t> perft_divide(const ChessPosition &root, const move_list *moves, int depth,
+                                          int threads, PerftTable *table) {
+    std::vector<uint64_t> nodes(moves->move_count, depth <= 1 ? 1 : 0);
+    if (depth <= 1)
+        return nodes;
+
+    std::atomic<int> next_move(0);
+    auto worker = [&]() {
+        ChessPosition pos = root;
+        int i;
+        while ((i = next_move++) < moves->move_count) {
+            UndoInfo undo;
+            pos.apply_move(moves->moves[i], 0, &undo);
+            nodes[i] = pos.perft(depth - 1, table);
+            pos.revert_move(undo);
+        }
+    };
+
+    if (threads <= 1) {
+        worker();
+        return nodes;
+    }
+    std::vector<std::thread> pool;
+    for (int t = 0; t < threads; t++)
+        pool.emplace_back(worker);
+    for (auto &thread : pool)
+        thread.join();
+    return nodes;
+}
+
+typedef struct {
+    uint64_t nodes;
+    double seconds;
+} PerftResult;
+
+static PerftResult perft_timed(const ChessPosition &root, int depth, int threads, PerftTable *table) {
+    auto start = std::chrono::steady_clock::now();
+    ChessPosition pos = root;
+    move_list moves[1];
+    pos.generate_moves(moves);
+
+    PerftResult result;
+    result.nodes = 0;
+    if (depth == 0)
+        result.nodes = 1;
+    else
+        for (uint64_t nodes : perft_divide(pos, moves, depth, threads, table))
+            result.nodes += nodes;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+// The usual perft test positions, with their node counts at depths 1 to 6
+typedef struct {
+    const char *name;
+    const char *fen;
+    uint64_t nodes[6];
+} PerftPosition;
+
+static const PerftPosition perft_positions[] = {
+    {"startpos", start_position,
+        {20, 400, 8902, 197281, 4865609, 119060324}},
+    {"kiwipete", "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+        {48, 2039, 97862, 4085603, 193690690, 8031647685ULL}},
+    {"position3", "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+        {14, 191, 2812, 43238, 674624, 11030083}},
+    {"position4", "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+        {6, 264, 9467, 422333, 15833292, 706045033}},
+    {"position5", "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+        {44, 1486, 62379, 2103487, 89941194, 3048196529ULL}},
+    {"position6", "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+        {46, 2079, 89890, 3894594, 164075551, 6923051137ULL}},
+};
+
+#define PERFT_POSITIONS ((int)(sizeof(perft_positions) / sizeof(perft_positions[0])))
+#define PERFT_MAX_DEPTH 6
+
+// A game: the current position, the moves played to reach it and, once the
+// engine has been asked to search, a Searcher
+class ChessBoard : public ChessPosition {
+public:
+    ChessBoard(const std::string& fen) : ChessPosition(fen) {
+        nnue_network = NULL;
+    }
+
+    void parse_fen(char *fen){
+        ChessPosition::parse_fen(fen);
+        undo_stack.clear();
+        game_keys.clear();
+    }
+
+    void print_board(){
+        ChessPosition::print_board();
+        printf("Move Index:        %d\n\n", (int)undo_stack.size());
+    }
+
+    int make_move(int move){
+        UndoInfo undo;
+        int is_legal = apply_move(move, 0, &undo, NULL, 1);
+        if (is_legal){
+            undo_stack.push_back(undo);
+            game_keys.push_back(undo.hash_key);
+        }
+        return is_legal;
+    }
+
+    void undo_move(){
+        if (undo_stack.empty())
+            return;
+        revert_move(undo_stack.back());
+        undo_stack.pop_back();
+        game_keys.pop_back();
+    }
+
+    void search_position(const SearchLimits &limits){
+        if (!searcher)
+            searcher = std::make_shared<Searcher>();
+        searcher->set_nnue_network(nnue_network);
+        searcher->search_position(*this, game_keys.data(), (int)game_keys.size(), limits);
+    }
+
+    void search_position(int depth){
+        search_position(SearchLimits(depth));
+    }
+
+    // Best move found by the last search
+    int best_move(){
+        return searcher ? searcher->best_move() : 0;
+    }
+
+    // Searches of this game no longer draw on those of earlier ones
+    void new_game(){
+        if (searcher)
+            searcher->new_game();
+    }
+
+    // Statistics of the last search, NULL if there was none
+    const SearchStats *search_stats(){
+        return searcher ? &searcher->search_stats() : NULL;
+    }
+
+    void init_nnue(char *filename){
+        nnue_init(filename);
+    }
+
+    // Evaluate with the given network instead of the default one loaded by
+    // init_nnue, NULL to go back to it. The network is not owned and must
+    // outlive its use by this board.
+    void set_nnue_network(const NnueNetwork *network){
+        nnue_network = network;
+    }
+
+    // Search with the given Searcher, e.g. one shared by several boards
+    void set_searcher(std::shared_ptr<Searcher> shared_searcher){
+        searcher = shared_searcher;
+    }
+
+    std::shared_ptr<Searcher> get_searcher(){
+        return searcher;
+    }
+
+private:
+    std::vector<UndoInfo> undo_stack;
+    std::vector<U64> game_keys;
+    const NnueNetwork *nnue_network;
+    std::shared_ptr<Searcher> searcher;
 };
\ No newline at end of file
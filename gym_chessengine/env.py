@@ -1,3 +1,4 @@
+import asyncio
 import gymnasium as gym
 from gymnasium import spaces
 import numpy as np
@@ -10,7 +11,13 @@ class BaseEnv(gym.Env):
     def __init__(self, config=None) -> None:
         self.board = PyChessBoard() # type: ignore
         self.depth = config.get("depth", 2) if config else 6
+        # Further limits on the engine's search, 0 for none: seconds per move
+        # and nodes per move
+        self.movetime = config.get("movetime", 0) if config else 0
+        self.nodes = config.get("nodes", 0) if config else 0
         self.side = config.get("side", None) if config else None
+        # Statistics of the engine's last search, see PyChessBoard.search_stats
+        self.search_stats = {}
 
         self.action_space = spaces.Discrete(64 * 64)
         self.observation_space = spaces.Box(low=0, high=1, shape=(12, 8, 8), dtype=np.float64)
@@ -21,6 +28,7 @@ class BaseEnv(gym.Env):
         fen = options.get("fen") if options and "fen" in options else \
               "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"
         self.board.reset(fen)
+        self.board.new_game()
 
         if self.side and self.side != self.board.current_side():
             self.step(self.environment_move())
@@ -33,8 +41,22 @@ class BaseEnv(gym.Env):
         truncated = False  # Add logic if you support truncation
         return obs, reward, terminated, truncated, {}
 
-    def environment_move(self) -> int:
-        return self.board.environment_move(self.depth)
+    def environment_move(self, deadline: float = 0) -> int:
+        """Engine move; deadline, in seconds of time.monotonic(), stops the search early"""
+        move, self.search_stats = self.board.environment_move(self.depth, self.movetime, self.nodes, deadline,
+                                                              stats=True)
+        return move
+
+    async def environment_move_async(self, deadline: float = 0) -> int:
+        """Engine move, searched on a native thread without holding the GIL;
+        cancelling the task stops the search"""
+        self.board.start_search(self.depth, self.movetime, self.nodes, deadline)
+        try:
+            move = await asyncio.get_running_loop().run_in_executor(None, self.board.wait_search)
+            self.search_stats = self.board.search_stats()
+            return move
+        finally:
+            self.board.stop_search()
 
     def render(self, mode="human"):
         self.board.print_board()
@@ -45,9 +67,12 @@ class ChessSelfPlay(BaseEnv):
         super().__init__({"side": None})
 
 class ChessEngine(BaseEnv):
-    def __init__(self, depth = 6, side = "white"):
-        super().__init__({"depth": depth, "side": side})
-        self.board.init_engine()
+    def __init__(self, depth = 6, side = "white", network = None, movetime = 0, nodes = 0):
+        super().__init__({"depth": depth, "side": side, "movetime": movetime, "nodes": nodes})
+        if network is not None:
+            self.board.set_network(network)
+        else:
+            self.board.init_engine()
 
     def reset(self, seed=None, options=None):
         super().reset(seed=seed, options=options)
@@ -63,4 +88,7 @@ class ChessEngine(BaseEnv):
         obs, reward, terminated, truncated, info = super().step(action)
         if not terminated:
             obs, reward, terminated, truncated, info = super().step(self.environment_move())
+            # The board rewards the side that moved, here the engine
+            reward = -reward
+            info["search"] = self.search_stats
         return obs, reward, terminated, truncated, info
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <ctype.h>
 
 #include "misc.h"
@@ -78,6 +79,35 @@ void unmap_file(const void *data, map_t map)
 #endif
 }
 
+bool replace_file(const char *name, const void *head, size_t headSize,
+    const void *body, size_t bodySize)
+{
+  size_t len = strlen(name) + 32;
+  char *tmp = (char *)malloc(len);
+  if (!tmp) return false;
+#ifndef _WIN32
+  snprintf(tmp, len, "%s.%d.tmp", name, (int)getpid());
+#else
+  snprintf(tmp, len, "%s.%lu.tmp", name, GetCurrentProcessId());
+#endif
+
+  FILE *f = fopen(tmp, "wb");
+  bool success = f
+      && fwrite(head, 1, headSize, f) == headSize
+      && fwrite(body, 1, bodySize, f) == bodySize;
+  if (f && fclose(f) != 0)
+    success = false;
+#ifndef _WIN32
+  success = success && rename(tmp, name) == 0;
+#else
+  success = success && MoveFileEx(tmp, name, MOVEFILE_REPLACE_EXISTING);
+#endif
+  if (!success)
+    remove(tmp);
+  free(tmp);
+  return success;
+}
+
 /*
 FEN
 */
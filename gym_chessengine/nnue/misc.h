@@ -37,6 +37,11 @@ size_t file_size(FD fd);
 const void *map_file(FD fd, map_t *map);
 void unmap_file(const void *data, map_t map);
 
+/* Write head then body to a temporary file and move it over name, so that
+   readers never see a partial file */
+bool replace_file(const char *name, const void *head, size_t headSize,
+    const void *body, size_t bodySize);
+
 INLINE uint32_t readu_le_u32(const void *p)
 {
   const uint8_t *q = (const uint8_t*) p;
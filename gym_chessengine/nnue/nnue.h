@@ -39,35 +39,42 @@ const int pic_tab[14] = {
 #define COMBINE(c,x)     ((x) + (c) * 6) 
 
 /*nnue data*/
-#if 0
 typedef struct DirtyPiece {
   int dirtyNum;
   int pc[3];
   int from[3];
   int to[3];
 } DirtyPiece;
-#endif
 
 typedef struct {
   alignas(64) int16_t accumulation[2][256];
   bool computedAccumulation;
 } Accumulator;
 
+typedef struct NNUEdata {
+  Accumulator accumulator;
+  DirtyPiece dirtyPiece;
+} NNUEdata;
+
 /*position*/
 typedef struct Position {
   int player;
   int* pieces;
   int* squares;
-  Accumulator accumulator;
-#if 0
-  DirtyPiece dirtyPiece;
-#endif
+  NNUEdata* nnue;                   /* base of the per-ply stack */
+  int ply;                          /* nnue[ply] belongs to this position */
 } Position;
 
+/*network*/
+typedef struct NnueNetwork NnueNetwork;
+
 int nnue_evaluate_pos(Position* pos);
 
 /**
 * Load NNUE file
+* -------------------------------------------------
+* nnue_init loads the default network used by the nnue_evaluate* functions
+* below. Loading another file replaces it.
 */
 
 #ifdef __cplusplus
@@ -78,6 +85,17 @@ void nnue_init(
   const char * evalFile             /** Path to NNUE file */
 );
 
+/**
+* Default network loaded by nnue_init, NULL if none
+*/
+const NnueNetwork * nnue_default_network(void);
+
+/**
+* Name of the SIMD kernels used on this CPU:
+* "avx512", "avx2", "sse41", "sse2", "neon" or "generic"
+*/
+const char * nnue_arch_name(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -123,6 +141,105 @@ int nnue_evaluate(
   int* pieces,                      /** Array of pieces */
   int* squares                      /** Corresponding array of squares the piece stand on */
 );
+
+/**
+* Incremental evaluation.
+* -------------------------------------------------
+* Same input format as nnue_evaluate, plus a per-ply stack of NNUEdata
+* owned by the caller. nnue[ply] belongs to the current position and its
+* dirtyPiece records the move that led to it from nnue[ply-1], using the
+* piece codes and squares above (64 = off the board). pc[0] must be the
+* moving piece so that king moves are detected. The accumulator is updated
+* from the closest computed ancestor and only refreshed from scratch when a
+* king has moved since then.
+*/
+int nnue_evaluate_incremental(
+  int player,                       /** Side to move */
+  int* pieces,                      /** Array of pieces */
+  int* squares,                     /** Corresponding array of squares the piece stand on */
+  NNUEdata* nnue,                   /** Accumulator stack */
+  int ply                           /** Index of the current position in the stack */
+);
+
+/**
+* Batched evaluation.
+* -------------------------------------------------
+* Evaluates n positions at once, each layer being applied to a whole block
+* of positions before moving on to the next one. Position i is described by
+* players[i] and by pieces/squares starting at index NNUE_PIECES_STRIDE * i,
+* in the format of nnue_evaluate. Scores are written to scores[0..n-1].
+* Positions following one another in a game are best passed in that order:
+* each one's accumulator can then be derived from the previous one's.
+*/
+#define NNUE_PIECES_STRIDE 33
+
+void nnue_evaluate_batch(
+  int n,                            /** Number of positions */
+  const int* players,               /** Side to move of each position */
+  int* pieces,                      /** Arrays of pieces, one per position */
+  int* squares,                     /** Arrays of squares, one per position */
+  int* scores                       /** Output evaluations */
+);
+#ifdef __cplusplus
+}
+#endif
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/**
+* Independent networks.
+* -------------------------------------------------
+* A network is loaded once and only read afterwards, so it can be shared by
+* any number of boards and threads, and several of them can be loaded side
+* by side. The nnue_network_evaluate* functions take the same arguments as
+* their nnue_evaluate* counterparts above.
+*/
+NnueNetwork * nnue_network_load(
+  const char * evalFile             /** Path to NNUE file, NULL is returned if it can't be loaded */
+);
+
+/**
+* Same as nnue_network_load, through a weight cache: a copy of the weights
+* in the layout of the kernels picked for this CPU. It is mapped and used in
+* place when it matches evalFile and these kernels, so processes loading it
+* share a single copy of the weights. Otherwise it is (re)written from
+* evalFile.
+*/
+NnueNetwork * nnue_network_load_cached(
+  const char * evalFile,            /** Path to NNUE file */
+  const char * cacheFile            /** Path to the weight cache */
+);
+
+void nnue_network_free(
+  NnueNetwork * net                 /** Network to release, may be NULL */
+);
+
+int nnue_network_evaluate(
+  const NnueNetwork * net,
+  int player,
+  int* pieces,
+  int* squares
+);
+
+int nnue_network_evaluate_incremental(
+  const NnueNetwork * net,
+  int player,
+  int* pieces,
+  int* squares,
+  NNUEdata* nnue,
+  int ply
+);
+
+void nnue_network_evaluate_batch(
+  const NnueNetwork * net,
+  int n,
+  const int* players,
+  int* pieces,
+  int* squares,
+  int* scores
+);
 #ifdef __cplusplus
 }
 #endif
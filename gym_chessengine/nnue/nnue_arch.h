@@ -0,0 +1,85 @@
+#ifndef NNUE_ARCH_H
+#define NNUE_ARCH_H
+
+/*
+Internal interface between nnue.cpp and the builds of nnue_kernels.h for
+each instruction set (nnue_sse2.cpp, nnue_avx2.cpp, ...).
+*/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define NNUE_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define NNUE_ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#if !defined(IS_64BIT) && (defined(__x86_64__) || defined(_M_X64) || defined(__aarch64__))
+#define IS_64BIT
+#endif
+
+// The instruction set is chosen per translation unit, not by the build
+#undef USE_AVX512
+#undef USE_AVX2
+#undef USE_SSE41
+#undef USE_SSSE3
+#undef USE_SSE2
+#undef USE_SSE
+#undef USE_MMX
+#undef USE_NEON
+
+#include "nnue.h"
+
+// Layout of the evaluation file
+enum {
+  TransformerStart = 3 * 4 + 177,
+  NetworkStart = TransformerStart + 4 + 2 * 256 + 2 * 256 * 64 * 641
+};
+
+// Build the functions between PUSH and POP for the given target. The
+// headers above are included first so that none of their inline functions
+// get compiled for an instruction set the CPU may not have.
+#define NNUE_PRAGMA(x) _Pragma(#x)
+#if defined(__clang__)
+#define NNUE_TARGET_PUSH(t) \
+  NNUE_PRAGMA(clang attribute push(__attribute__((target(t))), apply_to = function))
+#define NNUE_TARGET_POP NNUE_PRAGMA(clang attribute pop)
+#elif defined(__GNUC__)
+#define NNUE_TARGET_PUSH(t) NNUE_PRAGMA(GCC push_options) NNUE_PRAGMA(GCC target(t))
+#define NNUE_TARGET_POP NNUE_PRAGMA(GCC pop_options)
+#else
+#define NNUE_TARGET_PUSH(t)
+#define NNUE_TARGET_POP
+#endif
+
+// Positions handed to evaluate_batch at once
+enum { kBatchBlock = 32 };
+
+// The weights are opaque outside of the kernels: weights_size() bytes,
+// 64-byte aligned, filled by init_weights.
+#define NNUE_DECLARE_ARCH(arch)                                         \
+  namespace nnue_##arch {                                               \
+    size_t weights_size(void);                                          \
+    void init_weights(void *weights, const void *evalData);             \
+    int evaluate_pos(const void *weights, Position *pos);               \
+    void evaluate_batch(const void *weights, Position *pos, int n,      \
+        int *scores);                                                   \
+  }
+
+NNUE_DECLARE_ARCH(generic)
+#if defined(NNUE_X86)
+NNUE_DECLARE_ARCH(sse2)
+NNUE_DECLARE_ARCH(sse41)
+NNUE_DECLARE_ARCH(avx2)
+NNUE_DECLARE_ARCH(avx512)
+#elif defined(NNUE_ARM_NEON)
+NNUE_DECLARE_ARCH(neon)
+#endif
+
+#endif
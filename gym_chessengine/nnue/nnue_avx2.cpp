@@ -0,0 +1,13 @@
+#include "nnue_arch.h"
+
+#if defined(NNUE_X86)
+NNUE_TARGET_PUSH("avx2")
+#define USE_AVX2
+#define USE_SSE41
+#define USE_SSSE3
+#define USE_SSE2
+#define USE_SSE
+#define NNUE_ARCH nnue_avx2
+#include "nnue_kernels.h"
+NNUE_TARGET_POP
+#endif
@@ -0,0 +1,7 @@
+#include "nnue_arch.h"
+
+#if defined(NNUE_ARM_NEON)
+#define USE_NEON
+#define NNUE_ARCH nnue_neon
+#include "nnue_kernels.h"
+#endif
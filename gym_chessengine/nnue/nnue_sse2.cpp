@@ -0,0 +1,10 @@
+#include "nnue_arch.h"
+
+#if defined(NNUE_X86)
+NNUE_TARGET_PUSH("sse2")
+#define USE_SSE2
+#define USE_SSE
+#define NNUE_ARCH nnue_sse2
+#include "nnue_kernels.h"
+NNUE_TARGET_POP
+#endif
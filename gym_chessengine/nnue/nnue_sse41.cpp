@@ -0,0 +1,12 @@
+#include "nnue_arch.h"
+
+#if defined(NNUE_X86)
+NNUE_TARGET_PUSH("sse4.1")
+#define USE_SSE41
+#define USE_SSSE3
+#define USE_SSE2
+#define USE_SSE
+#define NNUE_ARCH nnue_sse41
+#include "nnue_kernels.h"
+NNUE_TARGET_POP
+#endif
@@ -7,13 +7,34 @@ sources = [
     'gym_chessengine/binding.cpp',
     'gym_chessengine/nnue/misc.cpp',
     'gym_chessengine/nnue/nnue.cpp',
+    'gym_chessengine/nnue/nnue_sse2.cpp',
+    'gym_chessengine/nnue/nnue_sse41.cpp',
+    'gym_chessengine/nnue/nnue_avx2.cpp',
+    'gym_chessengine/nnue/nnue_avx512.cpp',
+    'gym_chessengine/nnue/nnue_neon.cpp',
 ]
 
+# Optionally embed the network in the extension, and a weight cache made for
+# the kernels of the target CPUs (see nnue_network_load_cached)
+define_macros = []
+embedded_network = os.environ.get('NNUE_EMBEDDED_NETWORK')
+if embedded_network:
+    define_macros += [('NNUE_EMBEDDED', None),
+                      ('DefaultEvalFile', '"%s"' % embedded_network)]
+    embedded_cache = os.environ.get('NNUE_EMBEDDED_CACHE')
+    if embedded_cache:
+        define_macros += [('NNUE_EMBEDDED_CACHE', '"%s"' % embedded_cache)]
+
+# Optionally time the hot paths of the search, see binding.profile_report
+if os.environ.get('ENGINE_PROFILE'):
+    define_macros += [('ENGINE_PROFILE', None)]
+
 # Define the extension module
 env_extension = Extension(
     'gym_chessengine.binding',
     sources=sources,
     include_dirs=['gym_chessengine', 'gym_chessengine/nnue', pybind11.get_include()],
+    define_macros=define_macros,
     language='c++', # Specify C++ language
     extra_compile_args=['-std=c++17'], # Use C++17 standard
 )